@@ -4,7 +4,18 @@ import os
 import pathlib
 
 from config import dataset_dir, bpe_path, output_dir
-from trashman import bpe_parse, bpe_save, bpe_free
+from trashman import bpe_train_dir, bpe_save, bpe_free
+
+# ---------------------------
+# BPE Config
+# ---------------------------
+
+vocab_size = 8192
+min_freq = 3
+
+# ---------------------------
+# Training Code
+# ---------------------------
 
 start = time.time()
 print("[INFO] Output path is", bpe_path)
@@ -13,11 +24,15 @@ if not os.path.isdir(output_dir):
     print("[INFO] Creating output directory")
     os.mkdir(output_dir)
 
-for filename in os.listdir(dataset_dir):
-    file_path = os.path.join(dataset_dir, filename)
-    bpe_parse(file_path)
+if bpe_train_dir(dataset_dir, os.cpu_count() or 1, vocab_size, min_freq) == 0:
+    print(f"[ERROR] Failed to train BPE on {dataset_dir}")
+    bpe_free()
+    exit(1)
 
-bpe_save(bpe_path)
+if bpe_save(bpe_path) != 0:
+    print(f"[ERROR] Failed to save BPE table to {bpe_path}")
+    bpe_free()
+    exit(1)
 bpe_free()
 
 end = time.time()
@@ -3,7 +3,7 @@ from shared import cuint, cstr
 
 lib = ctypes.CDLL("./.build/libjiraiya.so")
 
-lib.rnn.argtypes = [ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_char_p]
+lib.rnn.argtypes = [ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_int, ctypes.c_int, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_int, ctypes.c_float, ctypes.c_char_p]
 lib.rnn.restype = ctypes.c_int
 
 lib.load_model.argtypes = [ctypes.c_char_p]
@@ -12,8 +12,50 @@ lib.load_model.restype = ctypes.c_int
 lib.rnn_predict.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t]
 lib.rnn_predict.restype = ctypes.c_int
 
-def rnn(vocab_size, embedding_dim, hidden_layers, epochs, model_path):
-    return lib.rnn(cuint(vocab_size), cuint(embedding_dim), cuint(hidden_layers), cuint(epochs), cstr(model_path))
+lib.rnn_predict_batch.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_char_p), ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t)]
+lib.rnn_predict_batch.restype = ctypes.c_int
+
+lib.model_load.argtypes = [ctypes.c_char_p]
+lib.model_load.restype = ctypes.c_void_p
+
+lib.model_release.argtypes = [ctypes.c_void_p]
+lib.model_release.restype = None
+
+lib.rnn_session_create.argtypes = [ctypes.c_void_p]
+lib.rnn_session_create.restype = ctypes.c_void_p
+
+lib.rnn_session_append.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+lib.rnn_session_append.restype = ctypes.c_int
+
+lib.rnn_session_predict.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
+lib.rnn_session_predict.restype = ctypes.c_int
+
+lib.rnn_session_top_k.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t), ctypes.POINTER(ctypes.c_float)]
+lib.rnn_session_top_k.restype = ctypes.c_size_t
+
+lib.rnn_session_complete.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_float, ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t)]
+lib.rnn_session_complete.restype = ctypes.c_size_t
+
+lib.rnn_session_reset.argtypes = [ctypes.c_void_p]
+lib.rnn_session_reset.restype = None
+
+lib.rnn_session_free.argtypes = [ctypes.c_void_p]
+lib.rnn_session_free.restype = None
+
+lib.rnn_server_create.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t]
+lib.rnn_server_create.restype = ctypes.c_void_p
+
+lib.rnn_server_predict.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t]
+lib.rnn_server_predict.restype = ctypes.c_int
+
+lib.rnn_server_free.argtypes = [ctypes.c_void_p]
+lib.rnn_server_free.restype = None
+
+CELLS = {"rnn": 0, "lstm": 1}
+OPTIMIZERS = {"sgd": 0, "momentum": 1, "adam": 2, "adamw": 3}
+
+def rnn(vocab_size, embedding_dim, hidden_layers, epochs, model_path, batch_size=32, threads=1, hogwild=False, cell="rnn", samples=0, head_size=0, optimizer="sgd", learning_rate=0.0):
+    return lib.rnn(cuint(vocab_size), cuint(embedding_dim), cuint(hidden_layers), cuint(epochs), cuint(batch_size), cuint(threads), ctypes.c_int(hogwild), ctypes.c_int(CELLS[cell]), cuint(samples), cuint(head_size), ctypes.c_int(OPTIMIZERS[optimizer]), ctypes.c_float(learning_rate), cstr(model_path))
 
 def load_model(model_path: str) -> int:
     return lib.load_model(cstr(model_path))
@@ -22,3 +64,56 @@ def rnn_predict(input_str: str, output_len: int = 128) -> str:
     buf = ctypes.create_string_buffer(output_len)
     lib.rnn_predict(cstr(input_str), buf, cuint(output_len))
     return buf.value.decode('utf-8')
+
+def rnn_predict_batch(inputs, model=None):
+    texts = (ctypes.c_char_p * len(inputs))(*[s.encode("utf-8") for s in inputs])
+    preds = (ctypes.c_size_t * len(inputs))()
+    if lib.rnn_predict_batch(model, texts, len(inputs), preds) != 0:
+        return None
+    return list(preds)
+
+def model_load(model_path: str):
+    return lib.model_load(cstr(model_path))
+
+def model_release(model):
+    lib.model_release(model)
+
+def rnn_session_create(model=None):
+    return lib.rnn_session_create(model)
+
+def rnn_session_append(session, text: str) -> int:
+    return lib.rnn_session_append(session, cstr(text))
+
+def rnn_session_predict(session, output_len: int = 128) -> str:
+    buf = ctypes.create_string_buffer(output_len)
+    lib.rnn_session_predict(session, buf, cuint(output_len))
+    return buf.value.decode('utf-8')
+
+def rnn_session_top_k(session, k: int = 5):
+    ids = (ctypes.c_size_t * k)()
+    probs = (ctypes.c_float * k)()
+    n = lib.rnn_session_top_k(session, k, ids, probs)
+    return [(ids[i], probs[i]) for i in range(n)]
+
+def rnn_session_complete(session, max_tokens: int = 16, beams: int = 4, top_p: float = 0.0):
+    ids = (ctypes.c_size_t * max_tokens)()
+    n = lib.rnn_session_complete(session, beams, top_p, max_tokens, ids)
+    return list(ids[:n])
+
+def rnn_session_reset(session):
+    lib.rnn_session_reset(session)
+
+def rnn_session_free(session):
+    lib.rnn_session_free(session)
+
+def rnn_server_create(model=None, threads=1, max_batch=32, deadline_us=2000):
+    return lib.rnn_server_create(model, cuint(threads), cuint(max_batch), cuint(deadline_us))
+
+def rnn_server_predict(server, input_str: str, output_len: int = 128) -> str:
+    buf = ctypes.create_string_buffer(output_len)
+    if lib.rnn_server_predict(server, cstr(input_str), buf, cuint(output_len)) != 0:
+        raise RuntimeError("rnn_server_predict failed")
+    return buf.value.decode('utf-8')
+
+def rnn_server_free(server):
+    lib.rnn_server_free(server)
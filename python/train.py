@@ -13,6 +13,14 @@ embedding_dim = 128
 hidden_layers = 32
 epochs = 10
 sequence_length = 32
+batch_size = 32
+threads = os.cpu_count() or 1
+hogwild = False
+cell = "lstm"
+samples = 0 # > 0 trains on a sampled softmax over that many tokens
+head_size = 0 # > 0 trains an adaptive softmax with that many tokens in the head
+optimizer = "adam"
+learning_rate = 0.0 # 0 uses the default of the optimizer
 
 # ---------------------------
 # Training Code
@@ -20,7 +28,7 @@ sequence_length = 32
 
 tokens_count = bpe_load(bpe_path)
 
-if rnn(tokens_count, embedding_dim, hidden_layers, epochs, model_path) > 0:
+if rnn(tokens_count, embedding_dim, hidden_layers, epochs, model_path, batch_size, threads, hogwild, cell, samples, head_size, optimizer, learning_rate) > 0:
     print("Training model failed!")
 
 bpe_free()
@@ -6,7 +6,20 @@ lib = ctypes.CDLL("./.build/libtrashman.so")
 lib.bpe_parse.argtypes = [ctypes.c_char_p]
 lib.bpe_parse.restype = ctypes.c_int
 
+lib.bpe_parse_files.argtypes = [ctypes.POINTER(ctypes.c_char_p), ctypes.c_size_t, ctypes.c_size_t]
+lib.bpe_parse_files.restype = ctypes.c_size_t
+
+lib.bpe_parse_dir.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+lib.bpe_parse_dir.restype = ctypes.c_size_t
+
+lib.bpe_train_files.argtypes = [ctypes.POINTER(ctypes.c_char_p), ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t]
+lib.bpe_train_files.restype = ctypes.c_size_t
+
+lib.bpe_train_dir.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t]
+lib.bpe_train_dir.restype = ctypes.c_size_t
+
 lib.bpe_save.argtypes = [ctypes.c_char_p]
+lib.bpe_save.restype = ctypes.c_int
 
 lib.bpe_load.argtypes = [ctypes.c_char_p]
 lib.bpe_load.restype = ctypes.c_size_t
@@ -14,10 +27,24 @@ lib.bpe_load.restype = ctypes.c_size_t
 lib.bpe_test.argtypes = [ctypes.c_char_p]
 lib.bpe_test.restype = ctypes.c_int
 
+lib.bpe_tokenizer_new.argtypes = []
+lib.bpe_tokenizer_new.restype = ctypes.c_void_p
+
+lib.bpe_tokenizer_update.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+lib.bpe_tokenizer_update.restype = ctypes.c_int
+
+lib.bpe_tokenizer_tokens.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(ctypes.c_size_t)]
+lib.bpe_tokenizer_tokens.restype = ctypes.POINTER(ctypes.c_uint32)
+
+lib.bpe_tokenizer_free.argtypes = [ctypes.c_void_p]
+
 lib.bpe_free.argtypes = []
 lib.bpe_token_string.argtypes = [ctypes.c_size_t]
 lib.bpe_token_string.restype = ctypes.c_char_p
 
+lib.bpe_decode.argtypes = [ctypes.POINTER(ctypes.c_size_t), ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t]
+lib.bpe_decode.restype = ctypes.c_size_t
+
 # --------------------------
 # Python wrapper functions
 # --------------------------
@@ -25,8 +52,22 @@ lib.bpe_token_string.restype = ctypes.c_char_p
 def bpe_parse(path: str) -> int:
     return lib.bpe_parse(cstr(path))
 
-def bpe_save(path: str):
-    lib.bpe_save(cstr(path))
+def bpe_parse_files(paths: list, threads: int) -> int:
+    arr = (ctypes.c_char_p * len(paths))(*[p.encode("utf-8") for p in paths])
+    return lib.bpe_parse_files(arr, cuint(len(paths)), cuint(threads))
+
+def bpe_parse_dir(path: str, threads: int) -> int:
+    return lib.bpe_parse_dir(cstr(path), cuint(threads))
+
+def bpe_train_files(paths: list, threads: int, vocab_size: int, min_freq: int) -> int:
+    arr = (ctypes.c_char_p * len(paths))(*[p.encode("utf-8") for p in paths])
+    return lib.bpe_train_files(arr, cuint(len(paths)), cuint(threads), cuint(vocab_size), cuint(min_freq))
+
+def bpe_train_dir(path: str, threads: int, vocab_size: int, min_freq: int) -> int:
+    return lib.bpe_train_dir(cstr(path), cuint(threads), cuint(vocab_size), cuint(min_freq))
+
+def bpe_save(path: str) -> int:
+    return lib.bpe_save(cstr(path))
 
 def bpe_load(path: str) -> int:
     return lib.bpe_load(cstr(path))
@@ -34,9 +75,33 @@ def bpe_load(path: str) -> int:
 def bpe_test(input: str) -> int:
     return lib.bpe_test(cstr(input))
 
+def bpe_tokenizer_new():
+    return lib.bpe_tokenizer_new()
+
+def bpe_tokenizer_update(tokenizer, path: str) -> int:
+    return lib.bpe_tokenizer_update(tokenizer, cstr(path))
+
+def bpe_tokenizer_tokens(tokenizer, path: str) -> list:
+    count = ctypes.c_size_t(0)
+    tokens = lib.bpe_tokenizer_tokens(tokenizer, cstr(path), ctypes.byref(count))
+    return tokens[:count.value] if tokens else []
+
+def bpe_tokenizer_free(tokenizer):
+    lib.bpe_tokenizer_free(tokenizer)
+
 def bpe_free():
     lib.bpe_free()
 
 def bpe_token_string(token_id: int) -> str:
     s = lib.bpe_token_string(cuint(token_id))
     return s.decode('utf-8') if s else '<UNK>'
+
+def bpe_decode(token_ids: list) -> str:
+    ids = (ctypes.c_size_t * len(token_ids))(*token_ids)
+    size = 256
+    while True:
+        buf = ctypes.create_string_buffer(size)
+        needed = lib.bpe_decode(ids, cuint(len(token_ids)), buf, cuint(size))
+        if needed < size:
+            return buf.value.decode('utf-8')
+        size = needed + 1
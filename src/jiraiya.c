@@ -5,103 +5,14 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stdint.h>
 #include <float.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include "trashman.h"
-
-extern Item **global_items;
-
-typedef struct Matrix {
-    float **data;
-    size_t row;
-    size_t col;
-} Matrix;
-
-typedef struct DenseLayer {
-    Matrix *weights;
-    float *bias;
-    size_t input_size;
-    size_t output_size;
-} DenseLayer;
-
-static Matrix *g_embedding_layer = NULL;
-static DenseLayer *g_input_layer = NULL;
-static DenseLayer *g_hidden_layer = NULL;
-static Matrix *g_Wy = NULL;
-static float *g_by = NULL;
-static size_t g_vocab_size = 0, g_embedding_dim = 0, g_hidden_dim = 0;
-
-int mat_rand_create(Matrix *mat, size_t row, size_t col) {
-    mat->row = row;
-    mat->col = col;
-    mat->data = malloc(row * sizeof(float *));
-    for(size_t i = 0; i < row; ++i) {
-        mat->data[i] = malloc(col * sizeof(float));
-        if(mat->data[i] == NULL) return 1;
-
-        for (size_t j = 0; j < col; ++j) {
-            mat->data[i][j] = ((float)rand() / RAND_MAX - 0.5f) * 0.01f;
-        }
-    }
-    return 0;
-}
-
-int mat_create_zero(Matrix *mat, size_t row, size_t col) {
-    mat->row = row;
-    mat->col = col;
-    mat->data = malloc(row * sizeof(float *));
-    for(size_t i = 0; i < row; ++i) {
-        mat->data[i] = malloc(col * sizeof(float));
-        if(mat->data[i] == NULL) return 1;
-
-        for (size_t j = 0; j < col; ++j) {
-            mat->data[i][j] = 0.0f;
-        }
-    }
-    return 0;
-}
-
-int mat_mul(Matrix *res, Matrix *a, Matrix *b) {
-    if(a->col != b->row) return 1;
-
-    if(mat_create_zero(res, a->row, b->col) > 0) return 1;
-
-    for(size_t i = 0; i < res->row; ++i) {
-        for (size_t j = 0; j < res->col; ++j) {
-            res->data[i][j] = 0.0f;
-            for (size_t k = 0; k < a->col; ++k)
-                res->data[i][j] += a->data[i][k] * b->data[k][j];
-        }
-    }
-
-    return 0;
-}
-
-void mat_free(Matrix *mat) {
-    for (size_t i = 0; i < mat->row; ++i)
-        free(mat->data[i]);
-    free(mat->data);
-}
-
-int dense_create(DenseLayer *dl, size_t input_size, size_t output_size) {
-    dl->input_size = input_size;
-    dl->output_size = output_size;
-
-    if(mat_rand_create(dl->weights, input_size, output_size) > 0) return 1;
-
-    dl->bias = malloc(output_size * sizeof(float));
-    if(dl->bias == NULL) return 1;
-
-    for (size_t i = 0; i < output_size; ++i)
-        dl->bias[i] = 0.0f;
-
-    return 0;
-}
-
-void dense_free(DenseLayer *dl) {
-    mat_free(dl->weights);
-    free(dl->bias);
-}
+#include "tensor.h"
 
 void softmax(float *x, size_t len, float *out) {
     float max = x[0];
@@ -119,42 +30,44 @@ float cross_entropy_loss(float *pred, size_t target, size_t len) {
     return -logf(pred[target] + eps);
 }
 
-void rnn_cell_forward(
-    float *x_t, // [embedding_dim]
-    float *h_prev, // [hidden_dim]
-    DenseLayer *input_layer, // Wx
-    DenseLayer *hidden_layer, // Wh
-    float *bias, // [hidden_dim]
-    float *h_t, // [hidden_dim] output
-    size_t embedding_dim,
-    size_t hidden_dim
-) {
-    for (size_t i = 0; i < hidden_dim; ++i) {
-        float sum = bias[i];
-        // Wx * x_t
-        for (size_t j = 0; j < embedding_dim; ++j)
-            sum += input_layer->weights->data[j][i] * x_t[j];
-        // Wh * h_prev
-        for (size_t j = 0; j < hidden_dim; ++j)
-            sum += hidden_layer->weights->data[j][i] * h_prev[j];
-        h_t[i] = tanhf(sum);
-    }
+//
+// Turn `logits` in place into the gradient of softmax + cross-entropy,
+// probs - onehot(target). Returns the loss, the most likely id goes to `pred`.
+//
+float softmax_cross_entropy(float *logits, size_t target, size_t len, size_t *pred) {
+    size_t best = 0;
+    for (size_t i = 1; i < len; ++i) if (logits[i] > logits[best]) best = i;
+    softmax(logits, len, logits);
+    float loss = cross_entropy_loss(logits, target, len);
+    logits[target] -= 1.0f;
+    *pred = best;
+    return loss;
 }
 
-void output_layer_forward(
-    float *h_t, // [hidden_dim]
-    Matrix *Wy, // [hidden_dim][vocab_size]
-    float *by,  // [vocab_size]
-    float *logits, // [vocab_size] output
-    size_t hidden_dim,
-    size_t vocab_size
-) {
-    for (size_t i = 0; i < vocab_size; ++i) {
-        float sum = by[i];
-        for (size_t j = 0; j < hidden_dim; ++j)
-            sum += h_t[j] * Wy->data[j][i];
-        logits[i] = sum;
+//
+// BPE-encode a buffer, merges are applied in the order they were learned.
+//
+size_t *bpe_encode(const char *input, size_t len, size_t *out_len) {
+    Symbol *items = bpe_lex(&global_symbols, input, len, 0);
+    size_t count = bpe_merge_symbols(&global_merges, items, arrlenu(items));
+
+    // Each remaining symbol is already a BPE token id
+    size_t *ids = NULL;
+    arrsetlen(ids, count);
+    for (size_t i = 0; i < count; ++i)
+        ids[i] = items[i];
+
+    /*
+    printf("[BPE ENCODE] Encoded IDs: ");
+    for (size_t i = 0; i < arrlenu(ids); ++i) {
+        printf("%zu ('%s') ", ids[i], bpe_token_string(ids[i]));
     }
+    printf("\n");
+    */
+
+    arrfree(items);
+    *out_len = arrlenu(ids);
+    return ids;
 }
 
 //
@@ -172,82 +85,17 @@ size_t *bpe_encode_file(const char *filepath, size_t *out_len) {
     fclose(file);
     input_stream[file_size] = '\0';
 
-    // Tokenize
-    stb_lexer lexer;
-    char string_store[1028];
-    stb_c_lexer_init(&lexer, input_stream, input_stream + file_size, string_store, sizeof(string_store));
-    int token = stb_c_lexer_get_token(&lexer);
-    Item **items = NULL;
-    while(token != 0) {
-        Item *itm = malloc(sizeof(Item));
-        itm->left = NULL;
-        itm->right = NULL;
-        itm->value.string = NULL;
-        copy_into_item(itm, &lexer);
-        arrput(items, itm);
-        token = stb_c_lexer_get_token(&lexer);
-    }
+    size_t *ids = bpe_encode(input_stream, file_size, out_len);
     free(input_stream);
-
-    // BPE merge logic: repeatedly merge pairs using global_pairs until only BPE tokens remain
-    // This mimics the logic in trashman.c
-    int changed = 1;
-    while (arrlenu(items) > 1 && changed) {
-        changed = 0;
-        for (size_t i = 0; i < arrlenu(global_pairs); ++i) {
-            Pair *pair = global_pairs[i];
-            for (size_t j = 0; j + 1 < arrlenu(items); ++j) {
-                if (items_equal(items[j], pair->a) && items_equal(items[j+1], pair->b)) {
-                    // Merge
-                    Item *merged = malloc(sizeof(Item));
-                    merged->id = pair->item_id;
-                    merged->left = items[j];
-                    merged->right = items[j+1];
-                    merged->value.string = NULL;
-                    // Remove j and j+1, insert merged at j
-                    items[j] = merged;
-                    arrdel(items, j+1);
-                    changed = 1;
-                    break;
-                }
-            }
-            if (changed) break;
-        }
-    }
-
-    // Now, each item in items is a BPE token (should correspond to global_items)
-    size_t *ids = NULL;
-    for (size_t i = 0; i < arrlenu(items); ++i) {
-        // Find the id in global_items
-        size_t found = 0;
-        for (size_t j = 0; j < arrlenu(global_items); ++j) {
-            if (items_equal(items[i], global_items[j])) {
-                arrput(ids, global_items[j]->id);
-                found = 1;
-                break;
-            }
-        }
-        if (!found) arrput(ids, 0); // fallback to 0 if not found
-    }
-
-    /*
-    printf("[BPE ENCODE] Encoded IDs: ");
-    for (size_t i = 0; i < arrlenu(ids); ++i) {
-        printf("%zu ('%s') ", ids[i], bpe_token_string(ids[i]));
-    }
-    printf("\n");
-    */
-
-    for (size_t i = 0; i < arrlenu(items); ++i) free(items[i]);
-    arrfree(items);
-    *out_len = arrlenu(ids);
     return ids;
 }
 
 //
-// Load all .js files in dataset dir and concatenate BPE ids
+// Load all .js files in dataset dir and concatenate BPE ids. When `counts` is
+// given it receives the frequency of every id, as an stb_ds array that runs
+// up to the largest id seen.
 //
-size_t *load_bpe_dataset(const char *dataset_dir, size_t *total_len) {
+size_t *load_bpe_dataset(const char *dataset_dir, size_t *total_len, size_t **counts) {
     DIR *dir = opendir(dataset_dir);
     if (!dir) return NULL;
     struct dirent *entry;
@@ -259,6 +107,10 @@ size_t *load_bpe_dataset(const char *dataset_dir, size_t *total_len) {
             size_t len = 0;
             size_t *ids = bpe_encode_file(path, &len);
             for (size_t i = 0; i < len; ++i) arrput(all_ids, ids[i]);
+            for (size_t i = 0; counts && i < len; ++i) {
+                while (arrlenu(*counts) <= ids[i]) arrput(*counts, 0);
+                (*counts)[ids[i]]++;
+            }
             arrfree(ids);
         }
     }
@@ -267,395 +119,2552 @@ size_t *load_bpe_dataset(const char *dataset_dir, size_t *total_len) {
     return all_ids;
 }
 
-void save_model(const char *path, Matrix *embedding_layer, DenseLayer *input_layer, DenseLayer *hidden_layer, Matrix *Wy, float *by, size_t vocab_size, size_t embedding_dim, size_t hidden_dim) {
-    FILE *f = fopen(path, "wb");
-    if (!f) {
-        fprintf(stderr, "[ERROR] Could not open model file for writing: %s\n", path);
-        return;
+//
+// Walker's alias table over ids weighted by count^power, for drawing in
+// O(1). Each slot keeps its own id with probability `prob` and hands over to
+// `alias` otherwise. `q` is the normalized distribution that is sampled.
+//
+typedef struct AliasTable {
+    float *prob;
+    size_t *alias;
+    float *q;
+    size_t len;
+} AliasTable;
+
+int alias_create(AliasTable *a, const size_t *counts, size_t count_len, size_t len, float power) {
+    a->len = len;
+    a->prob = malloc(len * sizeof(float));
+    a->alias = malloc(len * sizeof(size_t));
+    a->q = malloc(len * sizeof(float));
+    size_t *small = malloc(len * sizeof(size_t)), *large = malloc(len * sizeof(size_t));
+    if (!a->prob || !a->alias || !a->q || !small || !large) {
+        free(small); free(large);
+        return 1;
     }
-    //
-    // Save dimensions
-    //
-    fwrite(&vocab_size, sizeof(size_t), 1, f);
-    fwrite(&embedding_dim, sizeof(size_t), 1, f);
-    fwrite(&hidden_dim, sizeof(size_t), 1, f);
 
-    //
-    // Embedding layer
-    //
-    for (size_t i = 0; i < vocab_size; ++i)
-        fwrite(embedding_layer->data[i], sizeof(float), embedding_dim, f);
-    //
-    // Input layer weights and bias
-    //
-    for (size_t i = 0; i < embedding_dim; ++i)
-        fwrite(input_layer->weights->data[i], sizeof(float), hidden_dim, f);
-    fwrite(input_layer->bias, sizeof(float), hidden_dim, f);
+    double total = 0.0;
+    for (size_t i = 0; i < len; ++i) {
+        a->q[i] = i < count_len ? powf((float)counts[i], power) : 0.0f;
+        total += a->q[i];
+    }
+    if (total <= 0.0) {
+        for (size_t i = 0; i < len; ++i) a->q[i] = 1.0f;
+        total = len;
+    }
 
     //
-    // Hidden layer weights and bias
+    // Vose: slots under the mean borrow the rest of their probability from
+    // one above it
     //
-    for (size_t i = 0; i < hidden_dim; ++i)
-        fwrite(hidden_layer->weights->data[i], sizeof(float), hidden_dim, f);
-    fwrite(hidden_layer->bias, sizeof(float), hidden_dim, f);
+    size_t n_small = 0, n_large = 0;
+    for (size_t i = 0; i < len; ++i) {
+        a->q[i] /= total;
+        a->prob[i] = a->q[i] * len;
+        a->alias[i] = i;
+        if (a->prob[i] < 1.0f) small[n_small++] = i;
+        else large[n_large++] = i;
+    }
+    while (n_small > 0 && n_large > 0) {
+        size_t s = small[--n_small], l = large[n_large - 1];
+        a->alias[s] = l;
+        a->prob[l] -= 1.0f - a->prob[s];
+        if (a->prob[l] < 1.0f) {
+            --n_large;
+            small[n_small++] = l;
+        }
+    }
+    while (n_large > 0) a->prob[large[--n_large]] = 1.0f;
+    while (n_small > 0) a->prob[small[--n_small]] = 1.0f;
 
-    //
-    // Output layer weights and bias
-    //
-    for (size_t i = 0; i < hidden_dim; ++i)
-        fwrite(Wy->data[i], sizeof(float), vocab_size, f);
-    fwrite(by, sizeof(float), vocab_size, f);
-    fclose(f);
-    printf("[INFO] Model saved to %s\n", path);
+    free(small);
+    free(large);
+    return 0;
 }
 
-int rnn(size_t vocab_size, size_t embedding_dim, size_t hidden_dim, size_t epochs, const char *model_path) {
-    srand(time(NULL));
+void alias_free(AliasTable *a) {
+    free(a->prob); a->prob = NULL;
+    free(a->alias); a->alias = NULL;
+    free(a->q); a->q = NULL;
+}
 
-    Matrix *embedding_layer = malloc(sizeof(Matrix));
-    if (!embedding_layer || mat_rand_create(embedding_layer, vocab_size, embedding_dim) > 0) {
-        fprintf(stderr, "[ERROR] Failed to initialize embedding layer\n");
-        goto cleanup;
-    }
-    DenseLayer *input_layer = malloc(sizeof(DenseLayer));
-    if (!input_layer || dense_create(input_layer, embedding_dim, hidden_dim) > 0) {
-        fprintf(stderr, "[ERROR] Failed to initialize input layer\n");
-        goto cleanup;
-    }
-    DenseLayer *hidden_layer = malloc(sizeof(DenseLayer));
-    if (!hidden_layer || dense_create(hidden_layer, hidden_dim, hidden_dim) > 0) {
-        fprintf(stderr, "[ERROR] Failed to initialize hidden layer\n");
-        goto cleanup;
-    }
-    float *bias = calloc(hidden_dim, sizeof(float));
-    if (!bias) {
-        fprintf(stderr, "[ERROR] Failed to initialize bias\n");
-        goto cleanup;
+//
+// xorshift64*, one state per thread so sampling needs no lock.
+//
+uint64_t rng_next(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+size_t alias_sample(const AliasTable *a, uint64_t *rng) {
+    uint64_t r = rng_next(rng);
+    size_t slot = (r >> 32) % a->len;
+    float u = (float)(r & 0xFFFFFF) / (float)0x1000000;
+    return u < a->prob[slot] ? slot : a->alias[slot];
+}
+
+//
+// Recurrent cell. Every cell projects [x_t; h_prev] with one weight matrix
+// whose columns hold `gates` blocks of hidden_dim pre-activations:
+//
+//   RNN:  h = tanh(z)
+//   LSTM: i, f, g, o = sigmoid(z_i), sigmoid(z_f), tanh(z_g), sigmoid(z_o)
+//         c = f c_prev + i g, h = o tanh(c)
+//
+typedef enum CellType {
+    CELL_RNN = 0,
+    CELL_LSTM = 1,
+} CellType;
+
+size_t cell_gates(CellType cell) {
+    return cell == CELL_LSTM ? 4 : 1;
+}
+
+const char *cell_name(CellType cell) {
+    return cell == CELL_LSTM ? "LSTM" : "RNN";
+}
+
+//
+// Gate nonlinearities and state update of one sequence. `z` holds the gate
+// pre-activations and is left holding the activations, `c` may alias
+// `c_prev`. The RNN has no cell state and ignores both.
+//
+void cell_forward(CellType cell, float *z, const float *c_prev, float *c, float *h, size_t hidden_dim) {
+    if (cell == CELL_RNN) {
+        vec_tanh(z, hidden_dim);
+        memcpy(h, z, hidden_dim * sizeof(float));
+        return;
     }
+    float *i = z, *f = z + hidden_dim, *g = z + 2 * hidden_dim, *o = z + 3 * hidden_dim;
+    vec_sigmoid(i, 2 * hidden_dim); // i and f
+    vec_tanh(g, hidden_dim);
+    vec_sigmoid(o, hidden_dim);
+    for (size_t j = 0; j < hidden_dim; ++j)
+        c[j] = f[j] * c_prev[j] + i[j] * g[j];
+    memcpy(h, c, hidden_dim * sizeof(float));
+    vec_tanh(h, hidden_dim);
+    for (size_t j = 0; j < hidden_dim; ++j)
+        h[j] *= o[j];
+}
 
-    Matrix *Wy = malloc(sizeof(Matrix));
-    if (!Wy || mat_rand_create(Wy, hidden_dim, vocab_size) > 0) {
-        fprintf(stderr, "[ERROR] Failed to initialize output layer\n");
-        goto cleanup;
+//
+// Backward through cell_forward() for one sequence, given the gate
+// activations `z`. `dc` comes in holding the gradient of c from the next step
+// and leaves holding the one of c_prev. Writes the gradient of the gate
+// pre-activations to `dz`.
+//
+void cell_backward(CellType cell, const float *z, const float *c_prev, const float *c, const float *h, const float *dh, float *dc, float *dz, size_t hidden_dim) {
+    if (cell == CELL_RNN) {
+        for (size_t j = 0; j < hidden_dim; ++j)
+            dz[j] = dh[j] * (1.0f - h[j] * h[j]);
+        return;
     }
-    float *by = calloc(vocab_size, sizeof(float));
-    if (!by) {
-        fprintf(stderr, "[ERROR] Failed to initialize output bias\n");
-        goto cleanup;
+    const float *i = z, *f = z + hidden_dim, *g = z + 2 * hidden_dim, *o = z + 3 * hidden_dim;
+    float *di = dz, *df = dz + hidden_dim, *dg = dz + 2 * hidden_dim, *d_o = dz + 3 * hidden_dim;
+
+    // tanh(c), recomputed into the slot of do rather than divided out of h
+    memcpy(d_o, c, hidden_dim * sizeof(float));
+    vec_tanh(d_o, hidden_dim);
+    for (size_t j = 0; j < hidden_dim; ++j) {
+        float tc = d_o[j];
+        float dc_ = dc[j] + dh[j] * o[j] * (1.0f - tc * tc);
+        d_o[j] = dh[j] * tc * o[j] * (1.0f - o[j]);
+        di[j] = dc_ * g[j] * i[j] * (1.0f - i[j]);
+        df[j] = dc_ * c_prev[j] * f[j] * (1.0f - f[j]);
+        dg[j] = dc_ * i[j] * (1.0f - g[j] * g[j]);
+        dc[j] = dc_ * f[j];
     }
+}
 
-    printf("[INFO] Running RNN training...\n");
-    size_t sequence_length = 32;
-    float learning_rate = 0.01f;
+//
+// Adaptive softmax output head. Ids are ranked by frequency, the head scores
+// the cutoff[0] most frequent ones plus one entry per tail cluster, and
+// cluster c scores ranks [cutoff[c], cutoff[c + 1]) through a projection of
+// h down to dim[c], narrower for every cluster since rare ids carry less.
+// p(id) is p_head(id) in the head and p_head(c) p_c(id) in cluster c.
+//
+// A full softmax is the head with no clusters and every id in rank order.
+//
+#define RNN_MAX_CLUSTERS 4
 
-    //
-    // Load dataset
-    //
-    size_t dataset_len = 0;
-    size_t *dataset = load_bpe_dataset(".dataset", &dataset_len);
-    if (!dataset || dataset_len < sequence_length + 1) {
-        fprintf(stderr, "[ERROR] Not enough BPE data for training\n");
-        goto cleanup;
+typedef struct AdaptiveHead {
+    size_t clusters;
+    size_t cutoff[RNN_MAX_CLUSTERS + 1];
+    size_t dim[RNN_MAX_CLUSTERS];
+    size_t *order;               // [vocab_size], id of every rank
+    size_t *rank;                // [vocab_size], rank of every id
+    Tensor P[RNN_MAX_CLUSTERS];  // [hidden_dim][dim]
+    Tensor W[RNN_MAX_CLUSTERS];  // [dim][cluster size]
+    float *b[RNN_MAX_CLUSTERS];  // [cluster size]
+} AdaptiveHead;
+
+//
+// Head of `head_size` ids, clusters four times larger than the one before
+// and a quarter as wide, the last one taking whatever is left.
+//
+void head_plan(AdaptiveHead *head, size_t vocab_size, size_t hidden_dim, size_t head_size) {
+    memset(head, 0, sizeof(*head));
+    if (head_size == 0 || head_size >= vocab_size) return;
+    head->cutoff[0] = head_size;
+    size_t dim = hidden_dim;
+    while (head->cutoff[head->clusters] < vocab_size) {
+        size_t c = head->clusters++;
+        size_t end = head->cutoff[c] * 4;
+        if (end > vocab_size || head->clusters == RNN_MAX_CLUSTERS) end = vocab_size;
+        head->cutoff[c + 1] = end;
+        dim = dim / 4 > 8 ? dim / 4 : 8;
+        head->dim[c] = dim < hidden_dim ? dim : hidden_dim;
     }
-    float *h_prev = calloc(hidden_dim, sizeof(float));
-    float *h_t = calloc(hidden_dim, sizeof(float));
-    float *logits = calloc(vocab_size, sizeof(float));
-    float *probs = calloc(vocab_size, sizeof(float));
-    float *dlogits = calloc(vocab_size, sizeof(float));
-    float *dh = calloc(hidden_dim, sizeof(float));
-    float *dx = calloc(embedding_dim, sizeof(float));
+}
 
-    //
-    // BPTT gradients
-    //
-    float **dh_t = malloc(sequence_length * sizeof(float*));
-    float **dh_next = malloc(sequence_length * sizeof(float*));
-    for (size_t t = 0; t < sequence_length; ++t) {
-        dh_t[t] = calloc(hidden_dim, sizeof(float));
-        dh_next[t] = calloc(hidden_dim, sizeof(float));
+size_t cluster_size(const AdaptiveHead *head, size_t c) {
+    return head->cutoff[c + 1] - head->cutoff[c];
+}
+
+typedef struct IdCount {
+    size_t count;
+    size_t id;
+} IdCount;
+
+int id_count_cmp(const void *a, const void *b) {
+    const IdCount *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+//
+// Entry of the head that scores `id`, the id itself or its cluster.
+//
+size_t head_class(const AdaptiveHead *head, size_t id) {
+    if (head->clusters == 0) return id;
+    size_t rank = head->rank[id];
+    if (rank < head->cutoff[0]) return rank;
+    size_t c = 0;
+    while (rank >= head->cutoff[c + 1]) ++c;
+    return head->cutoff[0] + c;
+}
+
+//
+// Rank ids by descending count, ties and unseen ids by id.
+//
+int head_order(AdaptiveHead *head, const size_t *counts, size_t count_len, size_t vocab_size) {
+    IdCount *ids = malloc(vocab_size * sizeof(IdCount));
+    if (!ids) return 1;
+    for (size_t i = 0; i < vocab_size; ++i)
+        ids[i] = (IdCount){ i < count_len ? counts[i] : 0, i };
+    qsort(ids, vocab_size, sizeof(IdCount), id_count_cmp);
+    for (size_t r = 0; r < vocab_size; ++r) {
+        head->order[r] = ids[r].id;
+        head->rank[ids[r].id] = r;
     }
+    free(ids);
+    return 0;
+}
 
-    //
-    // Gradients for hidden weights and bias
-    //
-    Matrix *dWh = malloc(sizeof(Matrix));
-    mat_create_zero(dWh, hidden_dim, hidden_dim);
-    float *dbh = calloc(hidden_dim, sizeof(float));
-    size_t num_batches = (dataset_len - sequence_length) / sequence_length;
-    size_t *batch_indices = malloc(num_batches * sizeof(size_t));
-    for (size_t i = 0; i < num_batches; ++i) batch_indices[i] = i;
-    size_t correct = 0, total = 0;
-    for (size_t epoch = 0; epoch < epochs; ++epoch) {
-        //
-        // Shuffle batches
-        //
-        for (size_t i = num_batches - 1; i > 0; --i) {
-            size_t j = rand() % (i + 1);
-            size_t tmp = batch_indices[i];
-            batch_indices[i] = batch_indices[j];
-            batch_indices[j] = tmp;
-        }
-        float epoch_loss = 0.0f;
-        for (size_t b = 0; b < num_batches; ++b) {
-            size_t batch = batch_indices[b];
-            size_t start = batch * sequence_length;
-            size_t *input_seq = &dataset[start];
-            size_t *target_seq = &dataset[start + 1];
-            for (size_t i = 0; i < hidden_dim; ++i) h_prev[i] = 0.0f;
+//
+// Trainable parameters. W stacks the input rows Wx over the recurrent rows
+// Wh, so a step is the single product [x_t; h_prev] W. Wy and by are the
+// output head, see AdaptiveHead. Everything but the embedding lives in the
+// `dense` block, see dense_layout().
+//
+typedef struct RnnModel {
+    Tensor embedding; // [vocab_size][embedding_dim]
+    Tensor W;         // [embedding_dim + hidden_dim][gates * hidden_dim]
+    float *b;         // [gates * hidden_dim]
+    Tensor Wy;        // [hidden_dim][cutoff[0] + clusters], [hidden_dim][vocab_size] without clusters
+    float *by;
+    AdaptiveHead head;
+    float *dense;
+    size_t dense_len;
+    atomic_size_t refs; // of a loaded model, see model_load()
+    CellType cell;
+    size_t gates;
+    size_t vocab_size;
+    size_t embedding_dim;
+    size_t hidden_dim;
+} RnnModel;
 
-            //
-            // Store activations for BPTT
-            //
-            float **h_states = malloc((sequence_length + 1) * sizeof(float*));
-            for (size_t t = 0; t <= sequence_length; ++t) h_states[t] = calloc(hidden_dim, sizeof(float));
-            memcpy(h_states[0], h_prev, hidden_dim * sizeof(float));
+Tensor model_Wx(RnnModel *m) {
+    return tensor_view(&m->W, 0, m->embedding_dim);
+}
 
-            //
-            // Forward pass
-            //
-            for (size_t t = 0; t < sequence_length; ++t) {
-                float *x_t = embedding_layer->data[input_seq[t]];
-                rnn_cell_forward(x_t, h_states[t], input_layer, hidden_layer, bias, h_states[t+1], embedding_dim, hidden_dim);
-                output_layer_forward(h_states[t+1], Wy, by, logits, hidden_dim, vocab_size);
-                softmax(logits, vocab_size, probs);
-                float loss = cross_entropy_loss(probs, target_seq[t], vocab_size);
-                epoch_loss += loss;
-
-                //
-                // Accuracy
-                //
-                size_t pred = 0;
-                float max_prob = probs[0];
-                for (size_t i = 1; i < vocab_size; ++i) {
-                    if (probs[i] > max_prob) { max_prob = probs[i]; pred = i; }
-                }
-                if (pred == target_seq[t]) correct++;
-                total++;
-            }
+Tensor model_Wh(RnnModel *m) {
+    return tensor_view(&m->W, m->embedding_dim, m->hidden_dim);
+}
 
-            //
-            // Zero gradients
-            //
-            mat_create_zero(dWh, hidden_dim, hidden_dim);
-            memset(dbh, 0, hidden_dim * sizeof(float));
+//
+// The dense parameters of `m` back to back, each on its own cache lines and
+// vectors as single rows: W, b, Wy, by, then P, W and b of every cluster.
+// Places them, or gradients of the same shape, in `block` and returns the
+// floats they take. With `block` NULL only the length is of use.
+//
+Tensor dense_tensor(float *block, size_t *at, size_t row, size_t col) {
+    Tensor t = tensor_place(block != NULL ? block + *at : NULL, row, col);
+    *at += tensor_len(row, col);
+    return t;
+}
 
-            //
-            // Backward pass (BPTT)
-            //
-            memset(dh, 0, hidden_dim * sizeof(float));
-            for (int t = sequence_length - 1; t >= 0; --t) {
-                float *x_t = embedding_layer->data[input_seq[t]];
-                float *h_t_ = h_states[t+1];
-                float *h_prev_ = h_states[t];
-                output_layer_forward(h_t_, Wy, by, logits, hidden_dim, vocab_size);
-                softmax(logits, vocab_size, probs);
-                for (size_t i = 0; i < vocab_size; ++i)
-                    dlogits[i] = probs[i];
-                dlogits[target_seq[t]] -= 1.0f;
-                // Output layer gradients (as before)
-                for (size_t i = 0; i < vocab_size; ++i) {
-                    for (size_t j = 0; j < hidden_dim; ++j)
-                        Wy->data[j][i] -= learning_rate * dlogits[i] * h_t_[j];
-                    by[i] -= learning_rate * dlogits[i];
-                }
-                // dh = Wy * dlogits + dh_next
-                for (size_t j = 0; j < hidden_dim; ++j) {
-                    dh[j] = 0.0f;
-                    for (size_t i = 0; i < vocab_size; ++i)
-                        dh[j] += Wy->data[j][i] * dlogits[i];
-                    dh[j] += dh_next[t][j];
-                }
-                // Backprop through tanh
-                for (size_t j = 0; j < hidden_dim; ++j)
-                    dh[j] *= (1.0f - h_t_[j] * h_t_[j]);
-                // Accumulate gradients for hidden weights and bias
-                for (size_t i = 0; i < hidden_dim; ++i) {
-                    for (size_t j = 0; j < hidden_dim; ++j)
-                        dWh->data[j][i] += h_prev_[j] * dh[i];
-                    dbh[i] += dh[i];
-                }
-                // Accumulate gradients for input layer (as before)
-                for (size_t i = 0; i < embedding_dim; ++i)
-                    for (size_t j = 0; j < hidden_dim; ++j)
-                        input_layer->weights->data[i][j] -= learning_rate * dh[j] * x_t[i];
-                for (size_t i = 0; i < hidden_dim; ++i)
-                    bias[i] -= learning_rate * dh[i];
-                // Save dh for next step
-                if (t > 0) memcpy(dh_next[t-1], dh, hidden_dim * sizeof(float));
-            }
-            // Gradient clipping for hidden weights and bias
-            float clip = 5.0f;
-            for (size_t i = 0; i < hidden_dim; ++i) {
-                if (dbh[i] > clip) dbh[i] = clip;
-                if (dbh[i] < -clip) dbh[i] = -clip;
-                for (size_t j = 0; j < hidden_dim; ++j) {
-                    if (dWh->data[j][i] > clip) dWh->data[j][i] = clip;
-                    if (dWh->data[j][i] < -clip) dWh->data[j][i] = -clip;
-                }
-            }
-            // Update hidden layer weights and bias
-            for (size_t i = 0; i < hidden_dim; ++i) {
-                for (size_t j = 0; j < hidden_dim; ++j)
-                    hidden_layer->weights->data[j][i] -= learning_rate * dWh->data[j][i];
-                hidden_layer->bias[i] -= learning_rate * dbh[i];
-            }
-            // Free BPTT memory for this batch
-            for (size_t t = 0; t <= sequence_length; ++t) free(h_states[t]);
-            free(h_states);
-        }
-        printf("[INFO] Epoch %zu, avg loss: %.4f\n", epoch + 1, epoch_loss / (num_batches * sequence_length));
+size_t dense_layout(const RnnModel *m, float *block, Tensor *W, float **b, Tensor *Wy, float **by, Tensor *P, Tensor *Wc, float **bc) {
+    const AdaptiveHead *h = &m->head;
+    size_t at = 0, gates_dim = m->gates * m->hidden_dim;
+    size_t outputs = h->clusters > 0 ? h->cutoff[0] + h->clusters : m->vocab_size;
+    *W = dense_tensor(block, &at, m->embedding_dim + m->hidden_dim, gates_dim);
+    *b = dense_tensor(block, &at, 1, gates_dim).data;
+    *Wy = dense_tensor(block, &at, m->hidden_dim, outputs);
+    *by = dense_tensor(block, &at, 1, outputs).data;
+    for (size_t c = 0; c < h->clusters; ++c) {
+        P[c] = dense_tensor(block, &at, m->hidden_dim, h->dim[c]);
+        Wc[c] = dense_tensor(block, &at, h->dim[c], cluster_size(h, c));
+        bc[c] = dense_tensor(block, &at, 1, cluster_size(h, c)).data;
     }
-    float accuracy = (total > 0) ? (100.0f * correct / total) : 0.0f;
-    printf("[INFO] Training complete. Accuracy: %.2f%% (%zu/%zu)\n", accuracy, correct, total);
-    if (model_path) {
-        save_model(model_path, embedding_layer, input_layer, hidden_layer, Wy, by, vocab_size, embedding_dim, hidden_dim);
-    }
-
-    arrfree(dataset); dataset = NULL;
-    free(h_prev); h_prev = NULL;
-    free(h_t); h_t = NULL;
-    free(logits); logits = NULL;
-    free(probs); probs = NULL;
-    free(dlogits); dlogits = NULL;
-    free(dh); dh = NULL;
-    free(dx); dx = NULL;
-    for (size_t t = 0; t < sequence_length; ++t) { free(dh_t[t]); free(dh_next[t]); }
-    free(dh_t); free(dh_next);
-    mat_free(dWh); free(dWh); free(dbh); free(batch_indices);
+    return at;
+}
 
-cleanup:
-    if (embedding_layer) {
-        mat_free(embedding_layer);
-        free(embedding_layer);
-        embedding_layer = NULL;
-    }
-    if (input_layer) {
-        dense_free(input_layer);
-        free(input_layer);
-        input_layer = NULL;
-    }
-    if (hidden_layer) {
-        dense_free(hidden_layer);
-        free(hidden_layer);
-        hidden_layer = NULL;
-    }
-    if (Wy) {
-        mat_free(Wy);
-        free(Wy);
-        Wy = NULL;
-    }
-    if (by) { free(by); by = NULL; }
-    if (bias) { free(bias); bias = NULL; }
+//
+// Zeroed parameters, see model_create() for trainable ones. The shape of the
+// output head is taken from `head`, NULL for a full softmax. Ranks are left
+// for the caller to fill in.
+//
+int model_alloc(RnnModel *m, CellType cell, size_t vocab_size, size_t embedding_dim, size_t hidden_dim, const AdaptiveHead *head) {
+    m->cell = cell;
+    m->gates = cell_gates(cell);
+    m->vocab_size = vocab_size;
+    m->embedding_dim = embedding_dim;
+    m->hidden_dim = hidden_dim;
+    memset(&m->head, 0, sizeof(m->head));
+    if (head != NULL) {
+        m->head.clusters = head->clusters;
+        memcpy(m->head.cutoff, head->cutoff, sizeof(head->cutoff));
+        memcpy(m->head.dim, head->dim, sizeof(head->dim));
+    }
+    AdaptiveHead *h = &m->head;
+
+    if (tensor_create(&m->embedding, vocab_size, embedding_dim) > 0) {
+        fprintf(stderr, "[ERROR] Failed to initialize embedding layer\n");
+        return 1;
+    }
+    m->dense_len = dense_layout(m, NULL, &m->W, &m->b, &m->Wy, &m->by, h->P, h->W, h->b);
+    m->dense = vec_create(m->dense_len);
+    if (!m->dense) {
+        fprintf(stderr, "[ERROR] Failed to initialize %s cell and output layer\n", cell_name(cell));
+        return 1;
+    }
+    dense_layout(m, m->dense, &m->W, &m->b, &m->Wy, &m->by, h->P, h->W, h->b);
+    if (h->clusters == 0) return 0;
+
+    h->order = malloc(vocab_size * sizeof(size_t));
+    h->rank = malloc(vocab_size * sizeof(size_t));
+    if (!h->order || !h->rank) {
+        fprintf(stderr, "[ERROR] Failed to initialize adaptive softmax\n");
+        return 1;
+    }
     return 0;
 }
 
-int load_model(const char *path) {
-    printf("[INFO] Loading model from %s\n", path);
-
-    FILE *f = fopen(path, "rb");
-    if (!f) return 1;
-    fread(&g_vocab_size, sizeof(size_t), 1, f);
-    fread(&g_embedding_dim, sizeof(size_t), 1, f);
-    fread(&g_hidden_dim, sizeof(size_t), 1, f);
-
-    g_embedding_layer = malloc(sizeof(Matrix));
-    mat_create_zero(g_embedding_layer, g_vocab_size, g_embedding_dim);
-    for (size_t i = 0; i < g_vocab_size; ++i)
-        fread(g_embedding_layer->data[i], sizeof(float), g_embedding_dim, f);
-    g_input_layer = malloc(sizeof(DenseLayer));
-    g_input_layer->weights = malloc(sizeof(Matrix));
-    mat_create_zero(g_input_layer->weights, g_embedding_dim, g_hidden_dim);
-    for (size_t i = 0; i < g_embedding_dim; ++i)
-        fread(g_input_layer->weights->data[i], sizeof(float), g_hidden_dim, f);
-    g_input_layer->bias = malloc(g_hidden_dim * sizeof(float));
-    fread(g_input_layer->bias, sizeof(float), g_hidden_dim, f);
-    g_hidden_layer = malloc(sizeof(DenseLayer));
-    g_hidden_layer->weights = malloc(sizeof(Matrix));
-    mat_create_zero(g_hidden_layer->weights, g_hidden_dim, g_hidden_dim);
-    for (size_t i = 0; i < g_hidden_dim; ++i)
-        fread(g_hidden_layer->weights->data[i], sizeof(float), g_hidden_dim, f);
-    g_hidden_layer->bias = malloc(g_hidden_dim * sizeof(float));
-    fread(g_hidden_layer->bias, sizeof(float), g_hidden_dim, f);
-    g_Wy = malloc(sizeof(Matrix));
-    mat_create_zero(g_Wy, g_hidden_dim, g_vocab_size);
-    for (size_t i = 0; i < g_hidden_dim; ++i)
-        fread(g_Wy->data[i], sizeof(float), g_vocab_size, f);
-    g_by = malloc(g_vocab_size * sizeof(float));
-    fread(g_by, sizeof(float), g_vocab_size, f);
-    fclose(f);
+//
+// With `head` the output is an adaptive softmax ranked by `counts`.
+//
+int model_create(RnnModel *m, CellType cell, size_t vocab_size, size_t embedding_dim, size_t hidden_dim, const AdaptiveHead *head, const size_t *counts, size_t count_len) {
+    if (model_alloc(m, cell, vocab_size, embedding_dim, hidden_dim, head) > 0) return 1;
+    tensor_rand(&m->embedding);
+    tensor_rand(&m->W);
+    tensor_rand(&m->Wy);
+    // Forget gates start open so early gradients reach back through time
+    if (cell == CELL_LSTM) {
+        for (size_t j = 0; j < hidden_dim; ++j) m->b[hidden_dim + j] = 1.0f;
+    }
+    for (size_t c = 0; c < m->head.clusters; ++c) {
+        tensor_rand(&m->head.P[c]);
+        tensor_rand(&m->head.W[c]);
+    }
+    if (m->head.clusters > 0 && head_order(&m->head, counts, count_len, vocab_size) > 0) {
+        fprintf(stderr, "[ERROR] Failed to rank the vocabulary\n");
+        return 1;
+    }
     return 0;
 }
 
+void model_free(RnnModel *m) {
+    tensor_free(&m->embedding);
+    free(m->dense); m->dense = NULL;
+    m->W.data = m->Wy.data = m->b = m->by = NULL;
+    AdaptiveHead *h = &m->head;
+    for (size_t c = 0; c < h->clusters; ++c) {
+        h->P[c].data = h->W[c].data = h->b[c] = NULL;
+    }
+    free(h->order); h->order = NULL;
+    free(h->rank); h->rank = NULL;
+    h->clusters = 0;
+}
+
 //
-// Predict next token given input string (BPE-encoded)
+// The RNN with a full softmax keeps the original layout: Wx and the cell
+// bias, then Wh and a second, zero bias. Other models write a zero where the
+// vocabulary size would be, followed by the cell type, with MODEL_ADAPTIVE
+// set for an adaptive softmax, and store W and its bias whole. The shape and
+// ranks of an adaptive head follow the dimensions, its clusters follow by.
 //
-int rnn_predict(const char *input, char *output, size_t output_len) {
-    size_t input_len = strlen(input);
-    stb_lexer lexer;
-    char string_store[1028];
-    stb_c_lexer_init(&lexer, input, input + input_len, string_store, sizeof(string_store));
-    int token = stb_c_lexer_get_token(&lexer);
-    Item **items = NULL;
-    while(token != 0) {
-        Item *itm = malloc(sizeof(Item));
-        copy_into_item(itm, &lexer);
-        arrput(items, itm);
-        token = stb_c_lexer_get_token(&lexer);
+#define MODEL_ADAPTIVE 0x100
+
+//
+// Written to `path`.tmp and renamed over `path` once every write went
+// through, so a failed save leaves the previous model alone. Returns 0 on
+// success.
+//
+int save_model(const char *path, RnnModel *m) {
+    size_t path_len = strlen(path);
+    char *tmp_path = malloc(path_len + 5);
+    if (tmp_path == NULL) {
+        fprintf(stderr, "[ERROR] Could not save model: %s\n", path);
+        return 1;
     }
-    size_t *ids = NULL;
-    for (size_t i = 0; i < arrlenu(items); ++i) {
-        int found = 0;
-        for (size_t j = 0; j < arrlenu(global_pairs); ++j) {
-            if (items_equal(items[i], global_pairs[j]->a)) {
-                arrput(ids, global_pairs[j]->item_id);
-                found = 1;
-                break;
-            }
-        }
-        if (!found) arrput(ids, 0);
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f) {
+        fprintf(stderr, "[ERROR] Could not open model file for writing: %s\n", tmp_path);
+        free(tmp_path);
+        return 1;
     }
-    for (size_t i = 0; i < arrlenu(items); ++i) free(items[i]);
-    arrfree(items);
+    size_t gates_dim = m->gates * m->hidden_dim;
+    AdaptiveHead *h = &m->head;
 
     //
-    // Predict next token(s)
+    // Save dimensions
     //
-    float *h_prev = calloc(g_hidden_dim, sizeof(float));
-    float *h_t = calloc(g_hidden_dim, sizeof(float));
-    float *logits = calloc(g_vocab_size, sizeof(float));
-    float *probs = calloc(g_vocab_size, sizeof(float));
-    for (size_t t = 0; t < arrlenu(ids); ++t) {
-        float *x_t = g_embedding_layer->data[ids[t]];
-        rnn_cell_forward(x_t, h_prev, g_input_layer, g_hidden_layer, g_input_layer->bias, h_t, g_embedding_dim, g_hidden_dim);
-        for (size_t i = 0; i < g_hidden_dim; ++i) h_prev[i] = h_t[i];
+    int ok = 1;
+    if (m->cell != CELL_RNN || h->clusters > 0) {
+        size_t tag = 0, kind = m->cell | (h->clusters > 0 ? MODEL_ADAPTIVE : 0);
+        ok = fwrite(&tag, sizeof(size_t), 1, f) == 1;
+        ok = ok && fwrite(&kind, sizeof(size_t), 1, f) == 1;
+    }
+    ok = ok && fwrite(&m->vocab_size, sizeof(size_t), 1, f) == 1;
+    ok = ok && fwrite(&m->embedding_dim, sizeof(size_t), 1, f) == 1;
+    ok = ok && fwrite(&m->hidden_dim, sizeof(size_t), 1, f) == 1;
+    if (ok && h->clusters > 0) {
+        ok = fwrite(&h->clusters, sizeof(size_t), 1, f) == 1;
+        ok = ok && fwrite(h->cutoff, sizeof(size_t), h->clusters + 1, f) == h->clusters + 1;
+        ok = ok && fwrite(h->dim, sizeof(size_t), h->clusters, f) == h->clusters;
+        ok = ok && fwrite(h->order, sizeof(size_t), m->vocab_size, f) == m->vocab_size;
     }
 
     //
-    // Predict next token
+    // Embedding layer
     //
-    output[0] = '\0';
-    output_len = output_len > 0 ? output_len : 1;
-    output[output_len-1] = '\0';
-    output_layer_forward(h_t, g_Wy, g_by, logits, g_hidden_dim, g_vocab_size);
-    softmax(logits, g_vocab_size, probs);
+    ok = ok && tensor_write(&m->embedding, f) == 0;
 
     //
-    // Find most probable token id
+    // Cell weights and bias
     //
-    size_t pred = 0;
-    float max_prob = probs[0];
-    for (size_t i = 1; i < g_vocab_size; ++i) {
-        if (probs[i] > max_prob) { max_prob = probs[i]; pred = i; }
+    if (ok && m->cell == CELL_RNN && h->clusters == 0) {
+        Tensor Wx = model_Wx(m), Wh = model_Wh(m);
+        float *zero = vec_create(m->hidden_dim);
+        ok = zero != NULL;
+        ok = ok && tensor_write(&Wx, f) == 0;
+        ok = ok && fwrite(m->b, sizeof(float), m->hidden_dim, f) == m->hidden_dim;
+        ok = ok && tensor_write(&Wh, f) == 0;
+        ok = ok && fwrite(zero, sizeof(float), m->hidden_dim, f) == m->hidden_dim;
+        free(zero);
+    } else if (ok) {
+        ok = tensor_write(&m->W, f) == 0;
+        ok = ok && fwrite(m->b, sizeof(float), gates_dim, f) == gates_dim;
     }
 
-    // Clamp pred to valid range
-    if (pred >= g_vocab_size) pred = 0;
+    //
+    // Output layer weights and bias, then the tail clusters
+    //
+    ok = ok && tensor_write(&m->Wy, f) == 0;
+    ok = ok && fwrite(m->by, sizeof(float), m->Wy.col, f) == m->Wy.col;
+    for (size_t c = 0; ok && c < h->clusters; ++c) {
+        ok = tensor_write(&h->P[c], f) == 0 && tensor_write(&h->W[c], f) == 0;
+        ok = ok && fwrite(h->b[c], sizeof(float), cluster_size(h, c), f) == cluster_size(h, c);
+    }
+    if (fclose(f) != 0) ok = 0;
+    if (ok && rename(tmp_path, path) != 0) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "[ERROR] Could not write model file: %s\n", path);
+        remove(tmp_path);
+        free(tmp_path);
+        return 1;
+    }
+    free(tmp_path);
 
-    /*
-       printf("[RNN PREDICT] Predicted token id: %zu, string: '%s'\n", pred, bpe_token_string(pred));
-       snprintf(output, output_len, "%zu", pred);
-       */
+    printf("[INFO] Model saved to %s\n", path);
+    return 0;
+}
+
+//
+// Gradients of one minibatch, summed over its sequences and timesteps, laid
+// out like the dense block of the model so that `data` lines up with it.
+//
+typedef struct RnnGrads {
+    Tensor dW;
+    Tensor dWy;
+    float *db;
+    float *dby;
+    Tensor dP[RNN_MAX_CLUSTERS];
+    Tensor dWc[RNN_MAX_CLUSTERS];
+    float *dbc[RNN_MAX_CLUSTERS];
+    float *data;
+    size_t len;
+} RnnGrads;
+
+int grads_create(RnnGrads *g, RnnModel *m) {
+    g->len = m->dense_len;
+    g->data = vec_create(g->len);
+    if (g->data == NULL) return 1;
+    dense_layout(m, g->data, &g->dW, &g->db, &g->dWy, &g->dby, g->dP, g->dWc, g->dbc);
+    return 0;
+}
+
+void grads_zero(RnnGrads *g) {
+    memset(g->data, 0, g->len * sizeof(float));
+}
+
+void grads_add(RnnGrads *g, RnnGrads *other) {
+    vec_axpy(g->data, 1.0f, other->data, g->len);
+}
+
+void grads_free(RnnGrads *g) {
+    free(g->data); g->data = NULL;
+    g->len = 0;
+}
+
+//
+// Gradient of the embedding as the set of rows a batch touched, each id once.
+// `seen` and `slot_of` find the row of an id in constant time, `seen` holding
+// the `stamp` of the set it was last added in so clearing the set is O(1).
+//
+typedef struct SparseGrads {
+    size_t *ids;      // [capacity], in the order they were first added
+    Tensor rows;      // [capacity][embedding_dim]
+    size_t count;
+    size_t capacity;
+    size_t vocab_size;
+    uint32_t *seen;   // [vocab_size]
+    size_t *slot_of;  // [vocab_size]
+    uint32_t stamp;
+} SparseGrads;
+
+int sparse_create(SparseGrads *s, size_t vocab_size, size_t dim, size_t capacity) {
+    s->capacity = capacity < vocab_size ? capacity : vocab_size;
+    s->count = 0;
+    s->vocab_size = vocab_size;
+    s->stamp = 1;
+    s->ids = malloc(s->capacity * sizeof(size_t));
+    s->seen = calloc(vocab_size, sizeof(uint32_t));
+    s->slot_of = malloc(vocab_size * sizeof(size_t));
+    if (!s->ids || !s->seen || !s->slot_of) return 1;
+    return tensor_create(&s->rows, s->capacity, dim);
+}
+
+void sparse_clear(SparseGrads *s) {
+    s->count = 0;
+    if (++s->stamp == 0) {
+        memset(s->seen, 0, s->vocab_size * sizeof(uint32_t));
+        s->stamp = 1;
+    }
+}
+
+void sparse_add(SparseGrads *s, size_t id, const float *grad) {
+    if (s->seen[id] == s->stamp) {
+        vec_axpy(tensor_row(&s->rows, s->slot_of[id]), 1.0f, grad, s->rows.col);
+        return;
+    }
+    s->seen[id] = s->stamp;
+    s->slot_of[id] = s->count;
+    s->ids[s->count] = id;
+    memcpy(tensor_row(&s->rows, s->count++), grad, s->rows.col * sizeof(float));
+}
+
+void sparse_merge(SparseGrads *s, SparseGrads *other) {
+    for (size_t i = 0; i < other->count; ++i)
+        sparse_add(s, other->ids[i], tensor_row(&other->rows, i));
+}
+
+void sparse_free(SparseGrads *s) {
+    free(s->ids); s->ids = NULL;
+    free(s->seen); s->seen = NULL;
+    free(s->slot_of); s->slot_of = NULL;
+    tensor_free(&s->rows);
+    s->count = s->capacity = 0;
+}
+
+//
+// Optimizers. The moments of the dense block sit in flat arrays laid out like
+// it, so one step is a single fused pass, see vec_momentum() and vec_adam().
+//
+// The embedding keeps moments per row that are brought up to date lazily,
+// when a row is next touched. The steps it missed had no gradient, so its
+// moments only decayed, and under momentum kept moving the row, which is
+// replayed in closed form. Adam skips those moves like its lazy variants do.
+// Every row is caught up at the end of an epoch, see optimizer_flush().
+//
+typedef enum OptimizerType {
+    OPT_SGD = 0,
+    OPT_MOMENTUM = 1,
+    OPT_ADAM = 2,
+    OPT_ADAMW = 3,
+} OptimizerType;
+
+typedef struct Optimizer {
+    OptimizerType type;
+    float learning_rate;
+    float clip;
+    float beta1;
+    float beta2;
+    float eps;
+    float weight_decay;
+    float *m;          // [dense_len], first moment or velocity
+    float *v;          // [dense_len], second moment
+    Tensor em;         // [vocab_size][embedding_dim]
+    Tensor ev;         // [vocab_size][embedding_dim]
+    size_t *row_step;  // [vocab_size], step a row was last updated at
+} Optimizer;
+
+const char *optimizer_name(OptimizerType type) {
+    switch (type) {
+    case OPT_SGD: return "SGD";
+    case OPT_MOMENTUM: return "SGD with momentum";
+    case OPT_ADAM: return "Adam";
+    case OPT_ADAMW: return "AdamW";
+    }
+    return "unknown";
+}
+
+//
+// Moments for the parameters of `m`. A `learning_rate` of 0 picks the
+// default of the optimizer.
+//
+int optimizer_create(Optimizer *o, OptimizerType type, float learning_rate, RnnModel *m) {
+    *o = (Optimizer){ .type = type, .learning_rate = 0.01f, .clip = 5.0f };
+    size_t moments = 0;
+    switch (type) {
+    case OPT_SGD:
+        break;
+    case OPT_MOMENTUM:
+        o->beta1 = 0.9f;
+        moments = 1;
+        break;
+    case OPT_ADAMW:
+        o->weight_decay = 0.01f;
+        // fall through
+    case OPT_ADAM:
+        o->learning_rate = 0.002f;
+        o->beta1 = 0.9f;
+        o->beta2 = 0.999f;
+        o->eps = 1e-8f;
+        moments = 2;
+        break;
+    default:
+        fprintf(stderr, "[ERROR] Unknown optimizer %d\n", type);
+        return 1;
+    }
+    if (learning_rate > 0.0f) o->learning_rate = learning_rate;
+    if (moments == 0) return 0;
+
+    o->m = vec_create(m->dense_len);
+    o->row_step = calloc(m->vocab_size, sizeof(size_t));
+    if (!o->m || !o->row_step || tensor_create(&o->em, m->vocab_size, m->embedding_dim) > 0) return 1;
+    if (moments == 1) return 0;
+    o->v = vec_create(m->dense_len);
+    if (!o->v || tensor_create(&o->ev, m->vocab_size, m->embedding_dim) > 0) return 1;
+    return 0;
+}
+
+void optimizer_free(Optimizer *o) {
+    free(o->m); o->m = NULL;
+    free(o->v); o->v = NULL;
+    free(o->row_step); o->row_step = NULL;
+    tensor_free(&o->em);
+    tensor_free(&o->ev);
+}
+
+//
+// Kernel arguments of update `step`, counted from 1, along `scale` times
+// the gradients.
+//
+OptimizerStep optimizer_step(const Optimizer *o, size_t step, float scale) {
+    OptimizerStep s = { o->learning_rate, scale, o->clip, o->beta1, o->beta2, o->eps, o->learning_rate * o->weight_decay };
+    if (o->type == OPT_ADAM || o->type == OPT_ADAMW) {
+        float correction1 = 1.0f - powf(o->beta1, (float)step);
+        float correction2 = sqrtf(1.0f - powf(o->beta2, (float)step));
+        s.lr = o->learning_rate * correction2 / correction1;
+        s.eps = o->eps * correction2;
+    }
+    return s;
+}
+
+//
+// Plain SGD runs as momentum 0 with the gradient as its own velocity.
+//
+void optimizer_update(const Optimizer *o, const OptimizerStep *s, float *w, float *m, float *v, float *g, size_t len) {
+    if (o->type == OPT_ADAM || o->type == OPT_ADAMW) {
+        vec_adam(w, m, v, g, len, s);
+    } else {
+        vec_momentum(w, o->type == OPT_SGD ? g : m, g, len, s);
+    }
+}
+
+void optimizer_dense(const Optimizer *o, const OptimizerStep *s, RnnModel *m, RnnGrads *g) {
+    optimizer_update(o, s, m->dense, o->m, o->v, g->data, g->len);
+}
+
+//
+// Replay the `missed` steps without gradient of one embedding row.
+//
+void optimizer_catch_up(const Optimizer *o, const OptimizerStep *s, float *w, float *m, float *v, size_t len, size_t missed) {
+    float keep = powf(1.0f - s->decay, (float)missed);
+    float decay1 = powf(o->beta1, (float)missed);
+    if (o->type == OPT_MOMENTUM) {
+        // The velocity moved the row by lr (beta + ... + beta^missed) m
+        float drift = s->lr * o->beta1 * (1.0f - decay1) / (1.0f - o->beta1);
+        for (size_t j = 0; j < len; ++j) {
+            w[j] = keep * w[j] - drift * m[j];
+            m[j] *= decay1;
+        }
+        return;
+    }
+    float decay2 = powf(o->beta2, (float)missed);
+    for (size_t j = 0; j < len; ++j) {
+        w[j] *= keep;
+        m[j] *= decay1;
+        v[j] *= decay2;
+    }
+}
+
+//
+// Update the touched rows of the embedding alone at `step`.
+//
+void optimizer_rows(Optimizer *o, const OptimizerStep *s, Tensor *w, SparseGrads *rows, size_t step) {
+    size_t dim = rows->rows.col;
+    for (size_t i = 0; i < rows->count; ++i) {
+        size_t id = rows->ids[i];
+        float *wi = tensor_row(w, id), *g = tensor_row(&rows->rows, i);
+        float *m = NULL, *v = NULL;
+        if (o->type != OPT_SGD) {
+            m = tensor_row(&o->em, id);
+            if (o->ev.data != NULL) v = tensor_row(&o->ev, id);
+            if (o->row_step[id] + 1 < step)
+                optimizer_catch_up(o, s, wi, m, v, dim, step - o->row_step[id] - 1);
+            o->row_step[id] = step;
+        }
+        optimizer_update(o, s, wi, m, v, g, dim);
+    }
+}
+
+//
+// Bring every embedding row up to date after update `step`, before the
+// weights are read as a whole: evaluated, or saved.
+//
+void optimizer_flush(Optimizer *o, Tensor *w, size_t step) {
+    if (o->type == OPT_SGD) return;
+    OptimizerStep s = optimizer_step(o, step, 1.0f);
+    for (size_t id = 0; id < w->row; ++id) {
+        if (o->row_step[id] >= step) continue;
+        float *v = o->ev.data != NULL ? tensor_row(&o->ev, id) : NULL;
+        optimizer_catch_up(o, &s, tensor_row(w, id), tensor_row(&o->em, id), v, w->col, step - o->row_step[id]);
+        o->row_step[id] = step;
+    }
+}
+
+//
+// Activations of a minibatch of up to `capacity` sequences, stored time-major:
+// with `count` sequences in flight, step t owns rows [t * count, (t + 1) *
+// count) of every tensor, so each step and the whole batch are plain views.
+// Row s of step t in `xh` is [x_t | h_t] for sequence s, the input of the
+// cell, and the cell writes h_t+1 straight into step t + 1.
+//
+#define RNN_TRANSPOSE_ROWS 128
+#define RNN_TAIL_ROWS 128
+
+typedef struct RnnBatch {
+    Tensor xh;       // [(T + 1) * B][embedding_dim + hidden_dim], h_0 is zero
+    Tensor z;        // [T * B][gates * hidden_dim], gate activations
+    Tensor cs;       // [(T + 1) * B][hidden_dim], LSTM cell states, c_0 is zero
+    Tensor dh;       // [T * B][hidden_dim]
+    Tensor dz;       // [T * B][gates * hidden_dim]
+    Tensor dc;       // [B][hidden_dim]
+    Tensor dxs;      // [T * B][embedding_dim], gradient of the embedded inputs
+    Tensor dlogits;  // [T * B][outputs of the head], or [T * B][samples]
+    size_t sequence_length;
+    size_t capacity;
+    size_t count;
+
+    //
+    // Sampled softmax, see output_sampled()
+    //
+    size_t samples;
+    uint64_t rng;
+    Tensor logits;   // [B][vocab_size], full softmax of one step for evaluation
+    size_t *ids;     // [samples + T * B], the samples then the distinct targets
+    size_t *slots;   // [T * B], index of each row's target among the targets
+    uint32_t *seen;  // [vocab_size], `stamp` of the batch an id was last a target in
+    size_t *slot_of; // [vocab_size], its index among the targets of that batch
+    uint32_t stamp;
+    float *logq;     // [samples], log of the expected count of each sample
+    float *dt;       // [T * B], gradient of each row's target logit
+    float *dbs;      // [samples]
+    Tensor Ws;       // [hidden_dim][samples], the columns of Wy that were drawn
+    Tensor Ws_t;     // [samples][hidden_dim]
+    Tensor Wt_t;     // [T * B][hidden_dim], the columns of the targets
+    Tensor dWs;      // [hidden_dim][samples]
+    Tensor dWt_t;    // [T * B][hidden_dim]
+
+    //
+    // Adaptive softmax tails, see output_tails()
+    //
+    size_t *tail_rows; // [T * B]
+    Tensor th;         // [RNN_TAIL_ROWS][hidden_dim]
+    Tensor tp;         // [RNN_TAIL_ROWS][widest projection]
+    Tensor tdp;        // [RNN_TAIL_ROWS][widest projection]
+    Tensor tlogits;    // [RNN_TAIL_ROWS][largest cluster]
+} RnnBatch;
+
+int batch_create(RnnBatch *b, RnnModel *m, size_t sequence_length, size_t capacity, size_t samples) {
+    size_t rows = sequence_length * capacity;
+    b->sequence_length = sequence_length;
+    b->capacity = capacity;
+    b->count = 0;
+    b->samples = samples;
+    if (tensor_create(&b->xh, rows + capacity, m->embedding_dim + m->hidden_dim) > 0) return 1;
+    if (tensor_create(&b->z, rows, m->W.col) > 0) return 1;
+    if (tensor_create(&b->cs, rows + capacity, m->hidden_dim) > 0) return 1;
+    if (tensor_create(&b->dh, rows, m->hidden_dim) > 0) return 1;
+    if (tensor_create(&b->dz, rows, m->W.col) > 0) return 1;
+    if (tensor_create(&b->dc, capacity, m->hidden_dim) > 0) return 1;
+    if (tensor_create(&b->dxs, rows, m->embedding_dim) > 0) return 1;
+    if (tensor_create(&b->dlogits, rows, samples > 0 ? samples : m->Wy.col) > 0) return 1;
+
+    AdaptiveHead *h = &m->head;
+    if (h->clusters > 0) {
+        size_t dim = 0, size = 0;
+        for (size_t c = 0; c < h->clusters; ++c) {
+            if (h->dim[c] > dim) dim = h->dim[c];
+            if (cluster_size(h, c) > size) size = cluster_size(h, c);
+        }
+        if ((b->tail_rows = malloc(rows * sizeof(size_t))) == NULL) return 1;
+        if (tensor_create(&b->th, RNN_TAIL_ROWS, m->hidden_dim) > 0) return 1;
+        if (tensor_create(&b->tp, RNN_TAIL_ROWS, dim) > 0) return 1;
+        if (tensor_create(&b->tdp, RNN_TAIL_ROWS, dim) > 0) return 1;
+        if (tensor_create(&b->tlogits, RNN_TAIL_ROWS, size) > 0) return 1;
+    }
+    if (samples == 0) return 0;
+
+    b->rng = ((uint64_t)rand() << 32 | (uint64_t)rand()) | 1;
+    b->ids = malloc((samples + rows) * sizeof(size_t));
+    b->slots = malloc(rows * sizeof(size_t));
+    b->seen = calloc(m->vocab_size, sizeof(uint32_t));
+    b->slot_of = malloc(m->vocab_size * sizeof(size_t));
+    b->logq = malloc(samples * sizeof(float));
+    b->dt = malloc(rows * sizeof(float));
+    b->dbs = malloc(samples * sizeof(float));
+    if (!b->ids || !b->slots || !b->seen || !b->slot_of || !b->logq || !b->dt || !b->dbs) return 1;
+    if (tensor_create(&b->logits, capacity, m->vocab_size) > 0) return 1;
+    if (tensor_create(&b->Ws, m->hidden_dim, samples) > 0) return 1;
+    if (tensor_create(&b->Ws_t, samples, m->hidden_dim) > 0) return 1;
+    if (tensor_create(&b->Wt_t, rows, m->hidden_dim) > 0) return 1;
+    if (tensor_create(&b->dWs, m->hidden_dim, samples) > 0) return 1;
+    if (tensor_create(&b->dWt_t, rows, m->hidden_dim) > 0) return 1;
+    return 0;
+}
+
+void batch_free(RnnBatch *b) {
+    tensor_free(&b->xh);
+    tensor_free(&b->z);
+    tensor_free(&b->cs);
+    tensor_free(&b->dh);
+    tensor_free(&b->dz);
+    tensor_free(&b->dc);
+    tensor_free(&b->dxs);
+    tensor_free(&b->dlogits);
+    tensor_free(&b->logits);
+    free(b->ids); b->ids = NULL;
+    free(b->slots); b->slots = NULL;
+    free(b->seen); b->seen = NULL;
+    free(b->slot_of); b->slot_of = NULL;
+    free(b->logq); b->logq = NULL;
+    free(b->dt); b->dt = NULL;
+    free(b->dbs); b->dbs = NULL;
+    tensor_free(&b->Ws);
+    tensor_free(&b->Ws_t);
+    tensor_free(&b->Wt_t);
+    tensor_free(&b->dWs);
+    tensor_free(&b->dWt_t);
+    free(b->tail_rows); b->tail_rows = NULL;
+    tensor_free(&b->th);
+    tensor_free(&b->tp);
+    tensor_free(&b->tdp);
+    tensor_free(&b->tlogits);
+}
+
+//
+// Rows of `t` for steps [from, from + steps) of the current batch.
+//
+Tensor batch_steps(RnnBatch *b, Tensor *t, size_t from, size_t steps) {
+    return tensor_view(t, from * b->count, steps * b->count);
+}
+
+//
+// Hidden states h_1 .. h_T of the current batch, step t - 1 holding h_t.
+//
+Tensor batch_hidden(RnnBatch *b, RnnModel *m, size_t from, size_t steps) {
+    Tensor states = batch_steps(b, &b->xh, from + 1, steps);
+    return tensor_cols(&states, m->embedding_dim, m->hidden_dim);
+}
+
+//
+// Run the recurrence over the sequences starting at `starts` in `dataset`,
+// all advanced in lockstep so every step is one GEMM over the batch.
+//
+void rnn_batch_forward(RnnBatch *b, RnnModel *m, const size_t *dataset, const size_t *starts, size_t count) {
+    size_t embedding_dim = m->embedding_dim;
+    b->count = count;
+
+    Tensor xh0 = batch_steps(b, &b->xh, 0, 1);
+    Tensor c0 = batch_steps(b, &b->cs, 0, 1);
+    tensor_zero(&xh0);
+    tensor_zero(&c0);
+    for (size_t t = 0; t < b->sequence_length; ++t) {
+        Tensor xh = batch_steps(b, &b->xh, t, 1);
+        Tensor xh_next = batch_steps(b, &b->xh, t + 1, 1);
+        Tensor z = batch_steps(b, &b->z, t, 1);
+        Tensor c_prev = batch_steps(b, &b->cs, t, 1);
+        Tensor c = batch_steps(b, &b->cs, t + 1, 1);
+        for (size_t s = 0; s < count; ++s) {
+            memcpy(tensor_row(&xh, s), tensor_row(&m->embedding, dataset[starts[s] + t]), embedding_dim * sizeof(float));
+            memcpy(tensor_row(&z, s), m->b, z.col * sizeof(float));
+        }
+        mat_mul(&z, &xh, &m->W); // [X_t | H_t] W
+        for (size_t s = 0; s < count; ++s)
+            cell_forward(m->cell, tensor_row(&z, s), tensor_row(&c_prev, s), tensor_row(&c, s), tensor_row(&xh_next, s) + embedding_dim, m->hidden_dim);
+    }
+}
+
+//
+// Softmax of the output head for every step of every sequence, over the whole
+// vocabulary without clusters. The head projects the whole batch at once and
+// leaves the gradient of every step in `dlogits`, so the projection runs once
+// each way. Writes dh, adds to dWy and dby. Returns the summed loss.
+//
+// Accuracy counts the head ids here, the tail ids in output_tails().
+//
+float output_full(RnnBatch *b, RnnModel *m, RnnGrads *g, const Tensor *Wy_t, const size_t *dataset, const size_t *starts, size_t *correct) {
+    size_t T = b->sequence_length, count = b->count, outputs = m->Wy.col;
+    AdaptiveHead *head = &m->head;
+    Tensor hs = batch_hidden(b, m, 0, T);
+    Tensor dh = batch_steps(b, &b->dh, 0, T);
+    Tensor dlogits = batch_steps(b, &b->dlogits, 0, T);
+    float loss = 0.0f;
+
+    for (size_t r = 0; r < dlogits.row; ++r)
+        memcpy(tensor_row(&dlogits, r), m->by, outputs * sizeof(float));
+    mat_mul(&dlogits, &hs, &m->Wy);
+
+    for (size_t t = 0; t < T; ++t) {
+        for (size_t s = 0; s < count; ++s) {
+            size_t target = dataset[starts[s] + t + 1], pred = 0;
+            loss += softmax_cross_entropy(tensor_row(&dlogits, t * count + s), head_class(head, target), outputs, &pred);
+            if (head->clusters > 0) pred = pred < head->cutoff[0] ? head->order[pred] : m->vocab_size;
+            if (pred == target) (*correct)++;
+        }
+    }
+
+    // dWy = H^T dlogits, dby = sum of dlogits
+    mat_mul_tn(&g->dWy, &hs, &dlogits);
+    for (size_t r = 0; r < dlogits.row; ++r)
+        vec_axpy(g->dby, 1.0f, tensor_row(&dlogits, r), outputs);
+
+    // dh = dlogits Wy^T for every step
+    tensor_zero(&dh);
+    if (Wy_t != NULL) {
+        mat_mul(&dh, &dlogits, Wy_t);
+    } else {
+        mat_mul_nt(&dh, &dlogits, &m->Wy);
+    }
+    return loss;
+}
+
+//
+// Adaptive softmax tails. The rows whose target falls in cluster c go through
+// its projection RNN_TAIL_ROWS at a time, adding -log p_c(target) to the loss
+// next to the -log p_head(c) of output_full(). Adds to dh and the gradients
+// of the clusters. Returns the summed loss.
+//
+// A tail target counts as predicted when it is the best id of its cluster
+// and p_head(c) p_c(target) beats every other output of the head, read back
+// from the gradient output_full() left in `b->dlogits`. Other clusters are
+// taken at their whole mass, so this never counts an id inference would not
+// pick, but can miss one when another cluster spreads more mass thinly.
+//
+float output_tails(RnnBatch *b, RnnModel *m, RnnGrads *g, const size_t *dataset, const size_t *starts, size_t *correct) {
+    AdaptiveHead *head = &m->head;
+    size_t T = b->sequence_length, count = b->count, hidden_dim = m->hidden_dim, outputs = m->Wy.col;
+    Tensor hs = batch_hidden(b, m, 0, T);
+    Tensor dh = batch_steps(b, &b->dh, 0, T);
+    Tensor dlogits = batch_steps(b, &b->dlogits, 0, T);
+    float loss = 0.0f;
+
+    for (size_t c = 0; c < head->clusters; ++c) {
+        size_t n = 0, size = cluster_size(head, c);
+        for (size_t r = 0; r < T * count; ++r) {
+            size_t rank = head->rank[dataset[starts[r % count] + r / count + 1]];
+            if (rank >= head->cutoff[c] && rank < head->cutoff[c + 1]) b->tail_rows[n++] = r;
+        }
+
+        for (size_t from = 0; from < n; from += RNN_TAIL_ROWS) {
+            size_t rows = n - from < RNN_TAIL_ROWS ? n - from : RNN_TAIL_ROWS;
+            const size_t *tail = b->tail_rows + from;
+            Tensor th = tensor_view(&b->th, 0, rows);
+            Tensor tp_rows = tensor_view(&b->tp, 0, rows), tp = tensor_cols(&tp_rows, 0, head->dim[c]);
+            Tensor tdp_rows = tensor_view(&b->tdp, 0, rows), tdp = tensor_cols(&tdp_rows, 0, head->dim[c]);
+            Tensor tl_rows = tensor_view(&b->tlogits, 0, rows), tl = tensor_cols(&tl_rows, 0, size);
+
+            // Logits of the cluster, (H P) Wc
+            tensor_zero(&tp_rows);
+            for (size_t i = 0; i < rows; ++i) {
+                memcpy(tensor_row(&th, i), tensor_row(&hs, tail[i]), hidden_dim * sizeof(float));
+                memcpy(tensor_row(&tl, i), head->b[c], size * sizeof(float));
+            }
+            mat_mul(&tp, &th, &head->P[c]);
+            mat_mul(&tl, &tp, &head->W[c]);
+            for (size_t i = 0; i < rows; ++i) {
+                size_t r = tail[i], pred = 0;
+                size_t rank = head->rank[dataset[starts[r % count] + r / count + 1]];
+                float *tl_i = tensor_row(&tl, i);
+                loss += softmax_cross_entropy(tl_i, rank - head->cutoff[c], size, &pred);
+                if (pred != rank - head->cutoff[c]) continue;
+
+                const float *p = tensor_row(&dlogits, r);
+                size_t cluster = head->cutoff[0] + c;
+                float best = (p[cluster] + 1.0f) * (tl_i[pred] + 1.0f), other = 0.0f;
+                for (size_t j = 0; j < outputs; ++j)
+                    if (j != cluster && p[j] > other) other = p[j];
+                if (best >= other) (*correct)++;
+            }
+
+            // dWc = (H P)^T dlogits, dP = H^T (dlogits Wc^T), dH = dlogits Wc^T P^T
+            mat_mul_tn(&g->dWc[c], &tp, &tl);
+            for (size_t i = 0; i < rows; ++i)
+                vec_axpy(g->dbc[c], 1.0f, tensor_row(&tl, i), size);
+            tensor_zero(&tdp_rows);
+            mat_mul_nt(&tdp, &tl, &head->W[c]);
+            mat_mul_tn(&g->dP[c], &th, &tdp);
+            tensor_zero(&th);
+            mat_mul_nt(&th, &tdp, &head->P[c]);
+            for (size_t i = 0; i < rows; ++i)
+                vec_axpy(tensor_row(&dh, tail[i]), 1.0f, tensor_row(&th, i), hidden_dim);
+        }
+    }
+    return loss;
+}
+
+//
+// Sampled softmax. The batch shares `samples` ids drawn from `sampler`, and
+// each row scores its own target against them alone, every logit less the
+// log of how often its id is expected in the draw so the result stays an
+// unbiased estimate of the full softmax. A drawn id equal to the row's
+// target is masked out. Only the drawn and target columns of Wy are read
+// and written, so the cost follows `samples` instead of the vocabulary.
+// Writes dh, adds to dWy and dby. Returns the summed loss.
+//
+float output_sampled(RnnBatch *b, RnnModel *m, RnnGrads *g, const AliasTable *sampler, const size_t *dataset, const size_t *starts) {
+    size_t T = b->sequence_length, count = b->count, K = b->samples, hidden_dim = m->hidden_dim;
+    Tensor hs = batch_hidden(b, m, 0, T);
+    Tensor dh = batch_steps(b, &b->dh, 0, T);
+    Tensor logits = batch_steps(b, &b->dlogits, 0, T);
+    size_t rows = logits.row;
+    float loss = 0.0f;
+
+    //
+    // Draw the samples and collect the distinct targets after them
+    //
+    size_t *ids = b->ids, targets = 0;
+    for (size_t k = 0; k < K; ++k)
+        ids[k] = alias_sample(sampler, &b->rng);
+    if (++b->stamp == 0) {
+        memset(b->seen, 0, m->vocab_size * sizeof(uint32_t));
+        b->stamp = 1;
+    }
+    for (size_t t = 0; t < T; ++t) {
+        for (size_t s = 0; s < count; ++s) {
+            size_t target = dataset[starts[s] + t + 1];
+            if (b->seen[target] != b->stamp) {
+                b->seen[target] = b->stamp;
+                b->slot_of[target] = targets;
+                ids[K + targets++] = target;
+            }
+            b->slots[t * count + s] = b->slot_of[target];
+        }
+    }
+
+    //
+    // Gather the columns, one pass over the rows of Wy
+    //
+    Tensor Wt_t = tensor_view(&b->Wt_t, 0, targets);
+    for (size_t i = 0; i < hidden_dim; ++i) {
+        const float *wy = tensor_row(&m->Wy, i);
+        float *ws = tensor_row(&b->Ws, i);
+        for (size_t k = 0; k < K; ++k) {
+            ws[k] = wy[ids[k]];
+            TENSOR_AT(&b->Ws_t, k, i) = wy[ids[k]];
+        }
+        for (size_t u = 0; u < targets; ++u)
+            TENSOR_AT(&Wt_t, u, i) = wy[ids[K + u]];
+    }
+
+    //
+    // Corrected logits of the samples, one GEMM for the batch
+    //
+    float log_k = logf((float)K);
+    float *logq = b->logq;
+    for (size_t k = 0; k < K; ++k)
+        logq[k] = log_k + logf(sampler->q[ids[k]]);
+    for (size_t r = 0; r < rows; ++r) {
+        float *l = tensor_row(&logits, r);
+        for (size_t k = 0; k < K; ++k) l[k] = m->by[ids[k]] - logq[k];
+    }
+    mat_mul(&logits, &hs, &b->Ws);
+
+    //
+    // Softmax over [target, samples] for every row, turned into its gradient
+    //
+    for (size_t t = 0; t < T; ++t) {
+        for (size_t s = 0; s < count; ++s) {
+            size_t r = t * count + s, target = dataset[starts[s] + t + 1];
+            float *l = tensor_row(&logits, r);
+            float y = vec_dot(tensor_row(&hs, r), tensor_row(&Wt_t, b->slots[r]), hidden_dim) + m->by[target] - (log_k + logf(sampler->q[target]));
+            float max = y;
+            for (size_t k = 0; k < K; ++k) {
+                if (ids[k] == target) l[k] = -INFINITY;
+                if (l[k] > max) max = l[k];
+            }
+            float e = expf(y - max), sum = e;
+            for (size_t k = 0; k < K; ++k) {
+                l[k] = expf(l[k] - max);
+                sum += l[k];
+            }
+            for (size_t k = 0; k < K; ++k) l[k] /= sum;
+            b->dt[r] = e / sum - 1.0f;
+            loss += logf(sum) - (y - max);
+        }
+    }
+
+    //
+    // dh = dlogits Ws^T plus the target columns
+    //
+    tensor_zero(&dh);
+    mat_mul(&dh, &logits, &b->Ws_t);
+    for (size_t r = 0; r < rows; ++r)
+        vec_axpy(tensor_row(&dh, r), b->dt[r], tensor_row(&Wt_t, b->slots[r]), hidden_dim);
+
+    //
+    // dWs = H^T dlogits, the target columns get dt h, then both are added
+    // into their columns of dWy
+    //
+    Tensor dWt_t = tensor_view(&b->dWt_t, 0, targets);
+    tensor_zero(&b->dWs);
+    tensor_zero(&dWt_t);
+    mat_mul_tn(&b->dWs, &hs, &logits);
+    for (size_t r = 0; r < rows; ++r)
+        vec_axpy(tensor_row(&dWt_t, b->slots[r]), b->dt[r], tensor_row(&hs, r), hidden_dim);
+    for (size_t i = 0; i < hidden_dim; ++i) {
+        float *dwy = tensor_row(&g->dWy, i);
+        const float *dws = tensor_row(&b->dWs, i);
+        for (size_t k = 0; k < K; ++k) dwy[ids[k]] += dws[k];
+        for (size_t u = 0; u < targets; ++u) dwy[ids[K + u]] += TENSOR_AT(&dWt_t, u, i);
+    }
+    memset(b->dbs, 0, K * sizeof(float));
+    for (size_t r = 0; r < rows; ++r) {
+        vec_axpy(b->dbs, 1.0f, tensor_row(&logits, r), K);
+        g->dby[ids[K + b->slots[r]]] += b->dt[r];
+    }
+    for (size_t k = 0; k < K; ++k) g->dby[ids[k]] += b->dbs[k];
+    return loss;
+}
+
+//
+// BPTT from dh, which output_full() or output_sampled() left for every step.
+// Only the recurrence runs step by step. Adds to dW and db, leaves the
+// gradient of the embedded inputs in `dxs`.
+//
+void rnn_batch_backward(RnnBatch *b, RnnModel *m, RnnGrads *g) {
+    size_t T = b->sequence_length, count = b->count, embedding_dim = m->embedding_dim;
+    Tensor xhs = batch_steps(b, &b->xh, 0, T);
+    Tensor dzs = batch_steps(b, &b->dz, 0, T);
+
+    Tensor Wx = model_Wx(m), Wh = model_Wh(m);
+    Tensor dc = tensor_view(&b->dc, 0, count);
+    tensor_zero(&dc);
+    for (size_t t = T; t-- > 0;) {
+        Tensor xh_next = batch_steps(b, &b->xh, t + 1, 1);
+        Tensor z = batch_steps(b, &b->z, t, 1);
+        Tensor c_prev = batch_steps(b, &b->cs, t, 1);
+        Tensor c = batch_steps(b, &b->cs, t + 1, 1);
+        Tensor dh_t = batch_steps(b, &b->dh, t, 1);
+        Tensor dz = batch_steps(b, &b->dz, t, 1);
+        // Backprop through the gates
+        for (size_t s = 0; s < count; ++s) {
+            cell_backward(m->cell, tensor_row(&z, s), tensor_row(&c_prev, s), tensor_row(&c, s), tensor_row(&xh_next, s) + embedding_dim,
+                          tensor_row(&dh_t, s), tensor_row(&dc, s), tensor_row(&dz, s), m->hidden_dim);
+        }
+        // Carry dh back through the recurrence, dH_prev += dZ Wh^T
+        if (t > 0) {
+            Tensor dh_prev = batch_steps(b, &b->dh, t - 1, 1);
+            mat_mul_nt(&dh_prev, &dz, &Wh);
+        }
+    }
+
+    // dW = [X | H_prev]^T dZ, db = sum of dZ
+    mat_mul_tn(&g->dW, &xhs, &dzs);
+    for (size_t r = 0; r < dzs.row; ++r)
+        vec_axpy(g->db, 1.0f, tensor_row(&dzs, r), dzs.col);
+
+    // dX = dZ Wx^T, one row per embedded input
+    Tensor dxs = batch_steps(b, &b->dxs, 0, T);
+    tensor_zero(&dxs);
+    mat_mul_nt(&dxs, &dzs, &Wx);
+}
+
+//
+// Forward and backward pass over the sequences starting at `starts` in
+// `dataset`. Gradients are added to `g`, the ones of the embedded inputs are
+// left in `b->dxs`. With a `sampler` the loss is a sampled softmax and
+// `correct` is left alone, otherwise `Wy_t` is Wy transposed, or NULL to
+// multiply by Wy^T directly. The sampled softmax only works with a full
+// softmax head. Returns the summed loss.
+//
+float rnn_batch_train(RnnBatch *b, RnnModel *m, RnnGrads *g, const AliasTable *sampler, const Tensor *Wy_t, const size_t *dataset, const size_t *starts, size_t count, size_t *correct) {
+    rnn_batch_forward(b, m, dataset, starts, count);
+    float loss = sampler != NULL
+        ? output_sampled(b, m, g, sampler, dataset, starts)
+        : output_full(b, m, g, Wy_t, dataset, starts, correct);
+    if (m->head.clusters > 0)
+        loss += output_tails(b, m, g, dataset, starts, correct);
+    rnn_batch_backward(b, m, g);
+    return loss;
+}
+
+//
+// Loss and accuracy of the full softmax over the sequences starting at
+// `starts`, one step at a time through `b->logits`. Returns the summed loss.
+//
+float rnn_batch_eval(RnnBatch *b, RnnModel *m, const size_t *dataset, const size_t *starts, size_t count, size_t *correct) {
+    float loss = 0.0f;
+    rnn_batch_forward(b, m, dataset, starts, count);
+    Tensor logits = tensor_view(&b->logits, 0, count);
+    for (size_t t = 0; t < b->sequence_length; ++t) {
+        Tensor h = batch_hidden(b, m, t, 1);
+        for (size_t s = 0; s < count; ++s)
+            memcpy(tensor_row(&logits, s), m->by, m->vocab_size * sizeof(float));
+        mat_mul(&logits, &h, &m->Wy);
+        for (size_t s = 0; s < count; ++s) {
+            size_t target = dataset[starts[s] + t + 1], pred = 0;
+            loss += softmax_cross_entropy(tensor_row(&logits, s), target, m->vocab_size, &pred);
+            if (pred == target) (*correct)++;
+        }
+    }
+    return loss;
+}
+
+//
+// Sum the gradients of the embedded inputs in `b->dxs` into the rows of the
+// ids they were read from, so the cost follows the batch and not the
+// vocabulary.
+//
+void embedding_grads(RnnBatch *b, SparseGrads *s, const size_t *dataset, const size_t *starts) {
+    sparse_clear(s);
+    for (size_t t = 0; t < b->sequence_length; ++t) {
+        for (size_t i = 0; i < b->count; ++i)
+            sparse_add(s, dataset[starts[i] + t], tensor_row(&b->dxs, t * b->count + i));
+    }
+}
+
+//
+// Data-parallel training. Every worker runs its own minibatch of the shuffled
+// sequences, the calling thread being worker 0. The gradients are then summed
+// pairwise up a binary tree: at distance d, worker i adds the sum of worker
+// i + d once that one has published it, so the reduction takes log2(threads)
+// rounds and needs no lock. Worker 0 applies the update and everyone meets at
+// a barrier before the next step.
+//
+// The embedding gradient of every worker is the set of rows it read, see
+// SparseGrads. Worker 0 merges the sets and updates those rows alone. In
+// hogwild mode every worker instead writes its rows into the shared table as
+// soon as its backward pass is done, racing the others. Updates of rows read
+// by two workers at once may be lost, which sparse rows tolerate.
+//
+// With a sampler the workers train on a sampled softmax, and worker 0 scores
+// the full softmax on RNN_EVAL_SEQUENCES sequences spread over the dataset
+// after every epoch.
+//
+#define RNN_EVAL_SEQUENCES 256
+
+typedef struct RnnTrainer RnnTrainer;
+
+typedef struct RnnWorker {
+    RnnTrainer *trainer;
+    size_t id;
+    pthread_t thread;
+    RnnBatch batch;
+    RnnGrads grads;
+    SparseGrads dembedding;
+    size_t *starts;
+    float loss;
+    size_t correct;
+    atomic_size_t reduced; // last step whose subtree sum is in `grads`
+} RnnWorker;
+
+struct RnnTrainer {
+    RnnModel *model;
+    RnnWorker *workers;
+    size_t threads;
+    const size_t *dataset;
+    size_t *batch_indices;
+    size_t num_batches;
+    size_t sequence_length;
+    size_t batch_size;
+    size_t epochs;
+    Optimizer *optimizer;
+    int hogwild;
+    const AliasTable *sampler;
+    SparseGrads dembedding; // rows of every worker, merged by worker 0
+    size_t eval_correct; // of the last evaluation
+    size_t eval_tokens;
+    Tensor Wy_t; // Wy transposed, refreshed after every update
+    atomic_int ready;
+    atomic_size_t arrived;
+    atomic_size_t generation;
+};
+
+void trainer_barrier(RnnTrainer *tr) {
+    size_t generation = atomic_load_explicit(&tr->generation, memory_order_acquire);
+    if (atomic_fetch_add_explicit(&tr->arrived, 1, memory_order_acq_rel) + 1 == tr->threads) {
+        atomic_store_explicit(&tr->arrived, 0, memory_order_relaxed);
+        atomic_store_explicit(&tr->generation, generation + 1, memory_order_release);
+        return;
+    }
+    while (atomic_load_explicit(&tr->generation, memory_order_acquire) == generation)
+        sched_yield();
+}
+
+void trainer_reduce(RnnTrainer *tr, RnnWorker *w, size_t step) {
+    for (size_t d = 1; d < tr->threads; d <<= 1) {
+        if (w->id & d) break;
+        if (w->id + d >= tr->threads) continue;
+        RnnWorker *other = &tr->workers[w->id + d];
+        while (atomic_load_explicit(&other->reduced, memory_order_acquire) != step)
+            sched_yield();
+        grads_add(&w->grads, &other->grads);
+    }
+    atomic_store_explicit(&w->reduced, step, memory_order_release);
+}
+
+void trainer_update(RnnTrainer *tr, size_t step, float scale) {
+    RnnModel *m = tr->model;
+    OptimizerStep s = optimizer_step(tr->optimizer, step, scale);
+    optimizer_dense(tr->optimizer, &s, m, &tr->workers[0].grads);
+    if (!tr->hogwild) {
+        sparse_clear(&tr->dembedding);
+        for (size_t i = 0; i < tr->threads; ++i)
+            sparse_merge(&tr->dembedding, &tr->workers[i].dembedding);
+        optimizer_rows(tr->optimizer, &s, &m->embedding, &tr->dembedding, step);
+    }
+    if (tr->Wy_t.data != NULL) tensor_transpose(&tr->Wy_t, &m->Wy);
+}
+
+float trainer_eval(RnnTrainer *tr, RnnWorker *w) {
+    size_t n = tr->num_batches < RNN_EVAL_SEQUENCES ? tr->num_batches : RNN_EVAL_SEQUENCES;
+    float loss = 0.0f;
+    tr->eval_correct = 0;
+    tr->eval_tokens = n * tr->sequence_length;
+    for (size_t from = 0; from < n; from += tr->batch_size) {
+        size_t count = n - from < tr->batch_size ? n - from : tr->batch_size;
+        for (size_t s = 0; s < count; ++s)
+            w->starts[s] = (from + s) * tr->num_batches / n * tr->sequence_length;
+        loss += rnn_batch_eval(&w->batch, tr->model, tr->dataset, w->starts, count, &tr->eval_correct);
+    }
+    return loss;
+}
+
+void *trainer_worker(void *arg) {
+    RnnWorker *w = arg;
+    RnnTrainer *tr = w->trainer;
+    while (!atomic_load_explicit(&tr->ready, memory_order_acquire))
+        sched_yield();
+    if (w->id >= tr->threads) return NULL;
+
+    size_t T = tr->sequence_length;
+    size_t per_step = tr->threads * tr->batch_size;
+    size_t steps = (tr->num_batches + per_step - 1) / per_step;
+    const Tensor *Wy_t = tr->Wy_t.data != NULL ? &tr->Wy_t : NULL;
+    for (size_t epoch = 0; epoch < tr->epochs; ++epoch) {
+        if (w->id == 0) {
+            //
+            // Shuffle batches
+            //
+            for (size_t i = tr->num_batches - 1; i > 0; --i) {
+                size_t j = rand() % (i + 1);
+                size_t tmp = tr->batch_indices[i];
+                tr->batch_indices[i] = tr->batch_indices[j];
+                tr->batch_indices[j] = tmp;
+            }
+        }
+        trainer_barrier(tr);
+        w->loss = 0.0f;
+
+        for (size_t step = 0; step < steps; ++step) {
+            size_t update = epoch * steps + step + 1;
+            size_t first = step * per_step;
+            size_t total = tr->num_batches - first < per_step ? tr->num_batches - first : per_step;
+            size_t from = first + w->id * tr->batch_size;
+            size_t count = 0;
+            if (from < tr->num_batches)
+                count = tr->num_batches - from < tr->batch_size ? tr->num_batches - from : tr->batch_size;
+
+            grads_zero(&w->grads);
+            sparse_clear(&w->dembedding);
+            w->batch.count = count;
+            if (count > 0) {
+                for (size_t s = 0; s < count; ++s)
+                    w->starts[s] = tr->batch_indices[from + s] * T;
+                w->loss += rnn_batch_train(&w->batch, tr->model, &w->grads, tr->sampler, Wy_t, tr->dataset, w->starts, count, &w->correct);
+                embedding_grads(&w->batch, &w->dembedding, tr->dataset, w->starts);
+                if (tr->hogwild) {
+                    OptimizerStep s = optimizer_step(tr->optimizer, update, 1.0f / total);
+                    optimizer_rows(tr->optimizer, &s, &tr->model->embedding, &w->dembedding, update);
+                }
+            }
+            trainer_reduce(tr, w, update);
+            if (w->id == 0) trainer_update(tr, update, 1.0f / total);
+            trainer_barrier(tr);
+        }
+
+        if (w->id == 0) {
+            optimizer_flush(tr->optimizer, &tr->model->embedding, (epoch + 1) * steps);
+            float epoch_loss = 0.0f;
+            for (size_t i = 0; i < tr->threads; ++i) epoch_loss += tr->workers[i].loss;
+            if (tr->sampler == NULL) {
+                printf("[INFO] Epoch %zu, avg loss: %.4f\n", epoch + 1, epoch_loss / (tr->num_batches * T));
+            } else {
+                float eval_loss = trainer_eval(tr, w);
+                printf("[INFO] Epoch %zu, avg sampled loss: %.4f, full softmax loss: %.4f\n",
+                       epoch + 1, epoch_loss / (tr->num_batches * T), eval_loss / tr->eval_tokens);
+            }
+        }
+    }
+    return NULL;
+}
+
+//
+// Train on every .js file in .dataset. Each update averages the gradients of
+// `threads` minibatches of `batch_size` sequences, see trainer_worker().
+// With `samples` > 0 the output layer trains on a sampled softmax over that
+// many ids drawn by unigram frequency to the 3/4. With `head_size` > 0 it is
+// an adaptive softmax keeping that many of the most frequent ids in the head.
+// `optimizer` is an OptimizerType, run at `learning_rate` or its default
+// when that is 0.
+//
+int rnn(size_t vocab_size, size_t embedding_dim, size_t hidden_dim, size_t epochs, size_t batch_size, size_t threads, int hogwild, int cell, size_t samples, size_t head_size, int optimizer, float learning_rate, const char *model_path) {
+    srand(time(NULL));
+
+    RnnModel model = {0};
+    RnnTrainer trainer = {0};
+    RnnWorker *workers = NULL;
+    AliasTable sampler = {0};
+    AdaptiveHead head = {0};
+    Optimizer opt = {0};
+    size_t *dataset = NULL, *batch_indices = NULL, *counts = NULL;
+    int result = 1;
+
+    size_t sequence_length = 32;
+    if (batch_size == 0) batch_size = 1;
+    if (threads == 0) threads = 1;
+    if (samples >= vocab_size) samples = 0;
+    head_plan(&head, vocab_size, hidden_dim, head_size);
+
+    if (cell != CELL_RNN && cell != CELL_LSTM) {
+        fprintf(stderr, "[ERROR] Unknown cell type %d\n", cell);
+        goto cleanup;
+    }
+    if (samples > 0 && head.clusters > 0) {
+        fprintf(stderr, "[ERROR] Sampled softmax needs a full softmax head\n");
+        goto cleanup;
+    }
+
+    //
+    // Load dataset
+    //
+    size_t dataset_len = 0;
+    int need_counts = samples > 0 || head.clusters > 0;
+    dataset = load_bpe_dataset(".dataset", &dataset_len, need_counts ? &counts : NULL);
+    if (!dataset || dataset_len < sequence_length + 1) {
+        fprintf(stderr, "[ERROR] Not enough BPE data for training\n");
+        goto cleanup;
+    }
+    if (model_create(&model, cell, vocab_size, embedding_dim, hidden_dim, &head, counts, arrlenu(counts)) > 0)
+        goto cleanup;
+    if (samples > 0 && alias_create(&sampler, counts, arrlenu(counts), vocab_size, 0.75f) > 0) {
+        fprintf(stderr, "[ERROR] Failed to build the softmax sampler\n");
+        goto cleanup;
+    }
+
+    size_t num_batches = (dataset_len - 1) / sequence_length;
+    if (threads > (num_batches + batch_size - 1) / batch_size)
+        threads = (num_batches + batch_size - 1) / batch_size;
+    batch_indices = malloc(num_batches * sizeof(size_t));
+    workers = calloc(threads, sizeof(RnnWorker));
+    if (!batch_indices || !workers) {
+        fprintf(stderr, "[ERROR] Failed to initialize training buffers\n");
+        goto cleanup;
+    }
+    for (size_t i = 0; i < num_batches; ++i) batch_indices[i] = i;
+
+    trainer = (RnnTrainer){
+        .model = &model,
+        .workers = workers,
+        .threads = threads,
+        .dataset = dataset,
+        .batch_indices = batch_indices,
+        .num_batches = num_batches,
+        .sequence_length = sequence_length,
+        .batch_size = batch_size,
+        .epochs = epochs,
+        .optimizer = &opt,
+        .hogwild = hogwild,
+        .sampler = samples > 0 ? &sampler : NULL,
+    };
+    for (size_t i = 0; i < threads; ++i) {
+        RnnWorker *w = &workers[i];
+        w->trainer = &trainer;
+        w->id = i;
+        w->starts = malloc(batch_size * sizeof(size_t));
+        if (!w->starts || grads_create(&w->grads, &model) > 0 || batch_create(&w->batch, &model, sequence_length, batch_size, samples) > 0 ||
+            sparse_create(&w->dembedding, vocab_size, embedding_dim, sequence_length * batch_size) > 0) {
+            fprintf(stderr, "[ERROR] Failed to initialize training buffers\n");
+            goto cleanup;
+        }
+    }
+    if (optimizer_create(&opt, optimizer, learning_rate, &model) > 0) {
+        fprintf(stderr, "[ERROR] Failed to initialize the optimizer\n");
+        goto cleanup;
+    }
+    if (!hogwild && sparse_create(&trainer.dembedding, vocab_size, embedding_dim, threads * sequence_length * batch_size) > 0) {
+        fprintf(stderr, "[ERROR] Failed to initialize training buffers\n");
+        goto cleanup;
+    }
+    // dlogits Wy^T is a GEMM on Wy^T once there are enough rows to pay for
+    // the transpose
+    if (samples == 0 && batch_size * sequence_length >= RNN_TRANSPOSE_ROWS) {
+        if (tensor_create(&trainer.Wy_t, model.Wy.col, hidden_dim) > 0) {
+            fprintf(stderr, "[ERROR] Failed to initialize training buffers\n");
+            goto cleanup;
+        }
+        tensor_transpose(&trainer.Wy_t, &model.Wy);
+    }
+
+    //
+    // Workers wait for the final thread count, those that failed to start
+    // are left out of it
+    //
+    size_t started = 1;
+    for (; started < threads; ++started) {
+        if (pthread_create(&workers[started].thread, NULL, trainer_worker, &workers[started]) != 0)
+            break;
+    }
+    trainer.threads = started;
+    atomic_store_explicit(&trainer.ready, 1, memory_order_release);
+
+    printf("[INFO] Running %s training with %s kernels, batch size %zu on %zu threads%s...\n",
+           cell_name(model.cell), kernel_name(), batch_size, started, hogwild ? " (hogwild embeddings)" : "");
+    if (samples > 0)
+        printf("[INFO] Sampled softmax over %zu of %zu ids\n", samples, vocab_size);
+    printf("[INFO] %s at learning rate %g\n", optimizer_name(opt.type), opt.learning_rate);
+    if (head.clusters > 0)
+        printf("[INFO] Adaptive softmax with %zu ids in the head and %zu tail clusters\n", head.cutoff[0], head.clusters);
+    trainer_worker(&workers[0]);
+    for (size_t i = 1; i < started; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    size_t correct = 0, total = epochs * num_batches * sequence_length;
+    for (size_t i = 0; i < started; ++i) correct += workers[i].correct;
+    if (samples > 0) {
+        correct = trainer.eval_correct;
+        total = trainer.eval_tokens;
+    }
+    float accuracy = (total > 0) ? (100.0f * correct / total) : 0.0f;
+    printf("[INFO] Training complete. Accuracy: %.2f%% (%zu/%zu)\n", accuracy, correct, total);
+    if (model_path && save_model(model_path, &model) > 0)
+        goto cleanup;
+    result = 0;
+
+cleanup:
+    for (size_t i = 0; workers && i < threads; ++i) {
+        free(workers[i].starts);
+        batch_free(&workers[i].batch);
+        grads_free(&workers[i].grads);
+        sparse_free(&workers[i].dembedding);
+    }
+    free(workers);
+    sparse_free(&trainer.dembedding);
+    optimizer_free(&opt);
+    tensor_free(&trainer.Wy_t);
+    arrfree(dataset);
+    arrfree(counts);
+    alias_free(&sampler);
+    free(batch_indices);
+    model_free(&model);
+    return result;
+}
+
+int model_read(RnnModel *m, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 1;
+
+    size_t dims[3] = {0}, kind = CELL_RNN;
+    int ok = fread(&dims[0], sizeof(size_t), 1, f) == 1;
+    if (ok && dims[0] == 0)
+        ok = fread(&kind, sizeof(size_t), 1, f) == 1 && fread(&dims[0], sizeof(size_t), 1, f) == 1;
+    ok = ok && fread(&dims[1], sizeof(size_t), 2, f) == 2;
+    size_t cell = kind & ~(size_t)MODEL_ADAPTIVE;
+    ok = ok && (cell == CELL_RNN || cell == CELL_LSTM);
+
+    //
+    // Shape of an adaptive head, checked before anything is sized by it
+    //
+    AdaptiveHead head = {0};
+    if (ok && (kind & MODEL_ADAPTIVE)) {
+        ok = fread(&head.clusters, sizeof(size_t), 1, f) == 1;
+        ok = ok && head.clusters > 0 && head.clusters <= RNN_MAX_CLUSTERS;
+        ok = ok && fread(head.cutoff, sizeof(size_t), head.clusters + 1, f) == head.clusters + 1;
+        ok = ok && fread(head.dim, sizeof(size_t), head.clusters, f) == head.clusters;
+        ok = ok && head.cutoff[0] > 0 && head.cutoff[head.clusters] == dims[0];
+        for (size_t c = 0; ok && c < head.clusters; ++c)
+            ok = head.cutoff[c] < head.cutoff[c + 1] && head.dim[c] > 0;
+    }
+    ok = ok && model_alloc(m, cell, dims[0], dims[1], dims[2], &head) == 0;
+    AdaptiveHead *h = &m->head;
+    if (ok && h->clusters > 0) {
+        ok = fread(h->order, sizeof(size_t), m->vocab_size, f) == m->vocab_size;
+        for (size_t r = 0; ok && r < m->vocab_size; ++r) h->rank[r] = m->vocab_size;
+        for (size_t r = 0; ok && r < m->vocab_size; ++r) {
+            ok = h->order[r] < m->vocab_size && h->rank[h->order[r]] == m->vocab_size;
+            if (ok) h->rank[h->order[r]] = r;
+        }
+    }
+
+    ok = ok && tensor_read(&m->embedding, f) == 0;
+    if (ok && m->cell == CELL_RNN && h->clusters == 0) {
+        //
+        // Wx and its bias, Wh and a second bias that adds to the first
+        //
+        Tensor Wx = model_Wx(m), Wh = model_Wh(m);
+        float *bias = vec_create(m->hidden_dim);
+        ok = bias != NULL;
+        ok = ok && tensor_read(&Wx, f) == 0;
+        ok = ok && fread(m->b, sizeof(float), m->hidden_dim, f) == m->hidden_dim;
+        ok = ok && tensor_read(&Wh, f) == 0;
+        ok = ok && fread(bias, sizeof(float), m->hidden_dim, f) == m->hidden_dim;
+        if (ok) vec_axpy(m->b, 1.0f, bias, m->hidden_dim);
+        free(bias);
+    } else if (ok) {
+        ok = tensor_read(&m->W, f) == 0;
+        ok = ok && fread(m->b, sizeof(float), m->W.col, f) == m->W.col;
+    }
+    ok = ok && tensor_read(&m->Wy, f) == 0;
+    ok = ok && fread(m->by, sizeof(float), m->Wy.col, f) == m->Wy.col;
+    for (size_t c = 0; ok && c < h->clusters; ++c) {
+        ok = tensor_read(&h->P[c], f) == 0 && tensor_read(&h->W[c], f) == 0;
+        ok = ok && fread(h->b[c], sizeof(float), cluster_size(h, c), f) == cluster_size(h, c);
+    }
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "[ERROR] Could not read model file: %s\n", path);
+        model_free(m);
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Loaded models are never written again, so any number of threads can
+// predict from one copy of the weights, each through its own RnnSession.
+// They are shared by reference count: every session holds one, and the
+// last release frees the model. load_model() replaces the default model that
+// rnn_predict() and sessions created without a model use, which stays alive
+// for as long as sessions still hold it.
+//
+static RnnModel *g_model = NULL;
+static pthread_mutex_t g_model_lock = PTHREAD_MUTEX_INITIALIZER;
+
+RnnModel *model_load(const char *path) {
+    printf("[INFO] Loading model from %s\n", path);
+    RnnModel *m = calloc(1, sizeof(RnnModel));
+    if (m == NULL) return NULL;
+    if (model_read(m, path) > 0) {
+        free(m);
+        return NULL;
+    }
+    atomic_init(&m->refs, 1);
+    return m;
+}
+
+void model_retain(RnnModel *m) {
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+}
+
+void model_release(RnnModel *m) {
+    if (m == NULL || atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) != 1) return;
+    model_free(m);
+    free(m);
+}
+
+//
+// The default model with a reference for the caller, NULL if none is loaded.
+//
+RnnModel *model_default() {
+    pthread_mutex_lock(&g_model_lock);
+    RnnModel *m = g_model;
+    if (m != NULL) model_retain(m);
+    pthread_mutex_unlock(&g_model_lock);
+    return m;
+}
+
+//
+// Load the default model. On failure the previous one stays loaded.
+//
+int load_model(const char *path) {
+    RnnModel *m = model_load(path);
+    if (m == NULL) return 1;
+    pthread_mutex_lock(&g_model_lock);
+    RnnModel *old = g_model;
+    g_model = m;
+    pthread_mutex_unlock(&g_model_lock);
+    model_release(old);
+    return 0;
+}
+
+//
+// Scratch floats model_predict() needs.
+//
+size_t model_scratch(const RnnModel *m) {
+    const AdaptiveHead *h = &m->head;
+    size_t tail = 0;
+    for (size_t c = 0; c < h->clusters; ++c) {
+        size_t len = h->dim[c] + cluster_size(h, c);
+        if (len > tail) tail = len;
+    }
+    return m->Wy.col + tail;
+}
+
+//
+// Partial selection of the k best ids: a min-heap of the best k seen so far,
+// so a pass over n scores costs O(n log k) and only the survivors are sorted.
+// `ids` and `scores` are the caller's, k entries each.
+//
+typedef struct TopK {
+    size_t k;
+    size_t count;
+    size_t *ids;
+    float *scores;
+} TopK;
+
+void top_k_init(TopK *t, size_t k, size_t *ids, float *scores) {
+    *t = (TopK){ k, 0, ids, scores };
+}
+
+//
+// Score an id has to beat to get in, nothing gets into an empty selection.
+//
+float top_k_floor(const TopK *t) {
+    if (t->k == 0) return INFINITY;
+    return t->count < t->k ? -INFINITY : t->scores[0];
+}
+
+void top_k_sift(TopK *t, size_t i, size_t count) {
+    for (;;) {
+        size_t least = i, l = 2 * i + 1, r = l + 1;
+        if (l < count && t->scores[l] < t->scores[least]) least = l;
+        if (r < count && t->scores[r] < t->scores[least]) least = r;
+        if (least == i) return;
+        size_t id = t->ids[i]; t->ids[i] = t->ids[least]; t->ids[least] = id;
+        float score = t->scores[i]; t->scores[i] = t->scores[least]; t->scores[least] = score;
+        i = least;
+    }
+}
+
+void top_k_push(TopK *t, size_t id, float score) {
+    if (t->count < t->k) {
+        size_t i = t->count++;
+        while (i > 0 && t->scores[(i - 1) / 2] > score) {
+            t->ids[i] = t->ids[(i - 1) / 2];
+            t->scores[i] = t->scores[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        t->ids[i] = id;
+        t->scores[i] = score;
+    } else if (t->k > 0 && score > t->scores[0]) {
+        t->ids[0] = id;
+        t->scores[0] = score;
+        top_k_sift(t, 0, t->count);
+    }
+}
+
+//
+// Best first, which leaves `t` no longer a heap.
+//
+void top_k_sort(TopK *t) {
+    for (size_t n = t->count; n > 1; --n) {
+        size_t id = t->ids[0]; t->ids[0] = t->ids[n - 1]; t->ids[n - 1] = id;
+        float score = t->scores[0]; t->scores[0] = t->scores[n - 1]; t->scores[n - 1] = score;
+        top_k_sift(t, 0, n - 1);
+    }
+}
+
+//
+// The most probable next ids given the softmax of the head after hidden
+// state `h` in `probs`, best first. An adaptive head only opens a cluster
+// whose own probability beats the worst id kept so far, since no id inside
+// it can score higher. The clusters use `scratch`.
+//
+void model_top_k_head(const RnnModel *m, const float *h, const float *probs, float *scratch, TopK *t) {
+    const AdaptiveHead *head = &m->head;
+    if (head->clusters == 0) {
+        for (size_t i = 0; i < m->Wy.col; ++i)
+            if (probs[i] > top_k_floor(t)) top_k_push(t, i, probs[i]);
+        top_k_sort(t);
+        return;
+    }
+
+    for (size_t r = 0; r < head->cutoff[0]; ++r)
+        if (probs[r] > top_k_floor(t)) top_k_push(t, head->order[r], probs[r]);
+    for (size_t c = 0; c < head->clusters; ++c) {
+        float p_cluster = probs[head->cutoff[0] + c];
+        if (p_cluster <= top_k_floor(t)) continue;
+        size_t size = cluster_size(head, c);
+        float *proj = scratch, *tail = proj + head->dim[c];
+        memset(proj, 0, head->dim[c] * sizeof(float));
+        vec_mat(proj, h, &head->P[c]);
+        memcpy(tail, head->b[c], size * sizeof(float));
+        vec_mat(tail, proj, &head->W[c]);
+        softmax(tail, size, tail);
+        for (size_t j = 0; j < size; ++j) {
+            float p = p_cluster * tail[j];
+            if (p > top_k_floor(t)) top_k_push(t, head->order[head->cutoff[c] + j], p);
+        }
+    }
+    top_k_sort(t);
+}
+
+//
+// The most probable next ids after hidden state `h`, see model_top_k_head().
+//
+void model_top_k(const RnnModel *m, const float *h, float *scratch, TopK *t) {
+    size_t outputs = m->Wy.col;
+    float *probs = scratch;
+    memcpy(probs, m->by, outputs * sizeof(float));
+    vec_mat(probs, h, &m->Wy);
+    softmax(probs, outputs, probs);
+    model_top_k_head(m, h, probs, scratch + outputs, t);
+}
+
+//
+// Most probable next id after hidden state `h`.
+//
+size_t model_predict(const RnnModel *m, const float *h, float *scratch) {
+    size_t id = 0;
+    float p;
+    TopK t;
+    top_k_init(&t, 1, &id, &p);
+    model_top_k(m, h, scratch, &t);
+    return id;
+}
+
+//
+// One step of the recurrence on token `id`. `xh` holds [x_t | h_t], the cell
+// writes the next state over h_t once the product has consumed it.
+//
+void model_step(RnnModel *m, size_t id, float *xh, float *z, float *c) {
+    memcpy(xh, tensor_row(&m->embedding, id < m->vocab_size ? id : SYM_UNK), m->embedding_dim * sizeof(float));
+    memcpy(z, m->b, m->W.col * sizeof(float));
+    vec_mat(z, xh, &m->W);
+    cell_forward(m->cell, z, c, c, xh + m->embedding_dim, m->hidden_dim);
+}
+
+//
+// Prediction session over text typed a piece at a time. Tokens far enough
+// from the end of the text that later typing can no longer merge into them
+// are committed: the session keeps the state after them and drops their
+// text. An append re-encodes what is left and a prediction runs the
+// recurrence over it, so neither grows with the text typed before.
+//
+// A session belongs to one thread at a time. It holds a reference to its
+// model, so sessions on one model can run on as many threads as there are.
+//
+#define RNN_SESSION_LOOKBACK 16
+
+//
+// Completions, see rnn_session_complete(). A beam owns its own copy of the
+// recurrent state, the pools of beams are allocated with the session.
+//
+#define RNN_MAX_BEAMS 8
+#define RNN_MAX_COMPLETION 64
+#define RNN_NUCLEUS_MAX 64 // most probable ids nucleus sampling draws from
+
+typedef struct Beam {
+    float *xh;  // [embedding_dim + hidden_dim], after the ids so far
+    float *c;   // [hidden_dim]
+    size_t ids[RNN_MAX_COMPLETION];
+    size_t len;
+    float logp;
+} Beam;
+
+typedef struct RnnSession {
+    RnnModel *model;
+    char *text;      // stb_ds, the text after the committed tokens, NUL past its end
+    size_t *ids;     // stb_ds, BPE ids of `text`
+    size_t tokens;   // committed so far
+    float *xh;       // [embedding_dim + hidden_dim], h after the committed tokens
+    float *c;        // [hidden_dim]
+    float *run_xh;   // state while running `ids`
+    float *run_c;
+    float *z;        // [gates * hidden_dim]
+    float *scratch;  // see model_scratch()
+    float *states;   // of the beams
+    Beam beams[2 * RNN_MAX_BEAMS]; // live ones and their successors
+    Beam done;       // best finished completion
+    size_t top_ids[RNN_NUCLEUS_MAX];
+    float top_probs[RNN_NUCLEUS_MAX];
+    size_t candidates[RNN_MAX_BEAMS];
+    float candidate_logp[RNN_MAX_BEAMS];
+    uint64_t rng;
+} RnnSession;
+
+//
+// BPE-encode like bpe_encode(), `ends` receiving the offset just past the
+// text of every id. Free both with arrfree().
+//
+size_t *bpe_encode_ends(const char *input, size_t len, size_t *out_len, size_t **ends) {
+    size_t *lexeme_ends = NULL;
+    Symbol *items = bpe_lex_ends(&global_symbols, input, len, 0, &lexeme_ends);
+    size_t count = bpe_merge_symbols(&global_merges, items, arrlenu(items));
+
+    size_t *ids = NULL;
+    arrsetlen(ids, count);
+    arrsetlen(*ends, count);
+    for (size_t i = 0, lexeme = 0; i < count; ++i) {
+        ids[i] = items[i];
+        lexeme += sym_leaves(&global_symbols, items[i]);
+        (*ends)[i] = lexeme_ends[lexeme - 1];
+    }
+
+    arrfree(items);
+    arrfree(lexeme_ends);
+    *out_len = count;
+    return ids;
+}
+
+void rnn_session_free(RnnSession *s) {
+    if (s == NULL) return;
+    arrfree(s->text);
+    arrfree(s->ids);
+    free(s->xh);
+    free(s->c);
+    free(s->run_xh);
+    free(s->run_c);
+    free(s->z);
+    free(s->scratch);
+    free(s->states);
+    model_release(s->model);
+    free(s);
+}
+
+//
+// Session on `model`, or on the default model when that is NULL. Returns
+// NULL without a model.
+//
+RnnSession *rnn_session_create(RnnModel *model) {
+    RnnModel *m = model;
+    if (m != NULL) model_retain(m);
+    else m = model_default();
+    if (m == NULL) return NULL;
+
+    RnnSession *s = calloc(1, sizeof(RnnSession));
+    if (s == NULL) {
+        model_release(m);
+        return NULL;
+    }
+    s->model = m;
+    s->xh = vec_create(m->embedding_dim + m->hidden_dim);
+    s->c = vec_create(m->hidden_dim);
+    s->run_xh = vec_create(m->embedding_dim + m->hidden_dim);
+    s->run_c = vec_create(m->hidden_dim);
+    s->z = vec_create(m->W.col);
+    s->scratch = vec_create(model_scratch(m));
+    size_t state_dim = m->embedding_dim + m->hidden_dim;
+    s->states = vec_create(2 * RNN_MAX_BEAMS * (state_dim + m->hidden_dim));
+    if (!s->xh || !s->c || !s->run_xh || !s->run_c || !s->z || !s->scratch || !s->states) {
+        fprintf(stderr, "[ERROR] Failed to allocate a prediction session\n");
+        rnn_session_free(s);
+        return NULL;
+    }
+    for (size_t b = 0; b < 2 * RNN_MAX_BEAMS; ++b) {
+        s->beams[b].xh = s->states + b * (state_dim + m->hidden_dim);
+        s->beams[b].c = s->beams[b].xh + state_dim;
+    }
+    s->rng = ((uint64_t)(uintptr_t)s ^ (uint64_t)time(NULL) * 0x9E3779B97F4A7C15ull) | 1;
+    return s;
+}
+
+//
+// Forget everything typed so far.
+//
+void rnn_session_reset(RnnSession *s) {
+    RnnModel *m = s->model;
+    arrsetlen(s->text, 0);
+    arrsetlen(s->ids, 0);
+    s->tokens = 0;
+    memset(s->xh, 0, (m->embedding_dim + m->hidden_dim) * sizeof(float));
+    memset(s->c, 0, m->hidden_dim * sizeof(float));
+}
+
+int rnn_session_append(RnnSession *s, const char *text) {
+    RnnModel *m = s->model;
+    size_t len = strlen(text);
+    if (len == 0) return 0;
+
+    //
+    // NOTE: The lexer scans identifiers and numbers up to a NUL, so one is
+    // kept just past the end of `text` without counting it.
+    //
+    memcpy(arraddnptr(s->text, len + 1), text, len + 1);
+    arrsetlen(s->text, arrlenu(s->text) - 1);
+
+    size_t count = 0, *ends = NULL;
+    arrfree(s->ids);
+    s->ids = bpe_encode_ends(s->text, arrlenu(s->text), &count, &ends);
+
+    //
+    // Commit all but the last RNN_SESSION_LOOKBACK tokens once there are
+    // twice that many, so a commit happens every RNN_SESSION_LOOKBACK tokens
+    //
+    if (count >= 2 * RNN_SESSION_LOOKBACK) {
+        size_t commit = count - RNN_SESSION_LOOKBACK;
+        for (size_t t = 0; t < commit; ++t)
+            model_step(m, s->ids[t], s->xh, s->z, s->c);
+        arrdeln(s->text, 0, ends[commit - 1]);
+        s->text[arrlenu(s->text)] = '\0';
+        arrdeln(s->ids, 0, commit);
+        s->tokens += commit;
+    }
+    arrfree(ends);
+    return 0;
+}
+
+//
+// Run the uncommitted ids from the committed state into `run_xh` and `run_c`.
+//
+void session_run(RnnSession *s) {
+    RnnModel *m = s->model;
+    size_t state_dim = m->embedding_dim + m->hidden_dim;
+    memcpy(s->run_xh, s->xh, state_dim * sizeof(float));
+    memcpy(s->run_c, s->c, m->hidden_dim * sizeof(float));
+    for (size_t t = 0; t < arrlenu(s->ids); ++t)
+        model_step(m, s->ids[t], s->run_xh, s->z, s->run_c);
+}
+
+//
+// Write the id of the most probable next token after the text so far.
+//
+int rnn_session_predict(RnnSession *s, char *output, size_t output_len) {
+    RnnModel *m = s->model;
+    session_run(s);
+    size_t pred = model_predict(m, s->run_xh + m->embedding_dim, s->scratch);
+    if (pred >= m->vocab_size) pred = 0;
+    if (output_len > 0) snprintf(output, output_len, "%zu", pred);
+    return 0;
+}
+
+//
+// Up to `k` most probable next ids and their probabilities, best first.
+// Returns how many were written.
+//
+size_t rnn_session_top_k(RnnSession *s, size_t k, size_t *ids, float *probs) {
+    RnnModel *m = s->model;
+    if (k > m->vocab_size) k = m->vocab_size;
+    if (k == 0) return 0;
+    TopK t;
+    session_run(s);
+    top_k_init(&t, k, ids, probs);
+    model_top_k(m, s->run_xh + m->embedding_dim, s->scratch, &t);
+    return t.count;
+}
+
+//
+// Tokens are lexemes without the whitespace between them, so a line is over
+// once a token closes a statement or opens or closes a block.
+//
+int token_ends_line(size_t id) {
+    const char *text = bpe_token_string(id);
+    size_t len = text != NULL ? strlen(text) : 0;
+    return len > 0 && strchr(";{}", text[len - 1]) != NULL;
+}
+
+//
+// Index of the id drawn from the smallest prefix of the sorted `t` that
+// holds `top_p` of the probability mass.
+//
+size_t nucleus_sample(const TopK *t, float top_p, uint64_t *rng) {
+    size_t n = 0;
+    float mass = 0.0f;
+    while (n < t->count && mass < top_p) mass += t->scores[n++];
+    float r = (float)(rng_next(rng) >> 40) / (float)(1 << 24) * mass;
+    for (size_t i = 0; i + 1 < n; ++i) {
+        r -= t->scores[i];
+        if (r < 0.0f) return i;
+    }
+    return n > 0 ? n - 1 : 0;
+}
+
+//
+// Complete the text so far with up to `max_tokens` ids written to `ids`,
+// stopping early at the end of a line. With `beams` > 1 this is a beam
+// search over that many hypotheses, each step keeping the best by log
+// probability among the `beams` best successors of every live one, and the
+// completion with the best mean log probability wins. Otherwise with `top_p`
+// in (0, 1) every token is drawn from the nucleus of that much probability,
+// and without either it is greedy. Successors copy the state of their
+// parent, only the winners take a step. Returns how many ids were written.
+//
+size_t rnn_session_complete(RnnSession *s, size_t beams, float top_p, size_t max_tokens, size_t *ids) {
+    RnnModel *m = s->model;
+    size_t state_dim = m->embedding_dim + m->hidden_dim, vocab_size = m->vocab_size;
+    int sample = beams <= 1 && top_p > 0.0f && top_p < 1.0f;
+    if (beams == 0) beams = 1;
+    if (beams > RNN_MAX_BEAMS) beams = RNN_MAX_BEAMS;
+    if (max_tokens > RNN_MAX_COMPLETION) max_tokens = RNN_MAX_COMPLETION;
+    if (max_tokens == 0) return 0;
+
+    session_run(s);
+    Beam *live = s->beams, *next = s->beams + RNN_MAX_BEAMS;
+    memcpy(live[0].xh, s->run_xh, state_dim * sizeof(float));
+    memcpy(live[0].c, s->run_c, m->hidden_dim * sizeof(float));
+    live[0].len = 0;
+    live[0].logp = 0.0f;
+    s->done.len = 0;
+    float best = -INFINITY;
+
+    size_t count = 1;
+    while (count > 0) {
+        //
+        // Best successors of all live beams, as parent * vocab_size + id
+        //
+        TopK candidates;
+        top_k_init(&candidates, beams, s->candidates, s->candidate_logp);
+        for (size_t b = 0; b < count; ++b) {
+            TopK t;
+            top_k_init(&t, sample ? RNN_NUCLEUS_MAX : beams, s->top_ids, s->top_probs);
+            model_top_k(m, live[b].xh + m->embedding_dim, s->scratch, &t);
+            if (sample) {
+                size_t i = nucleus_sample(&t, top_p, &s->rng);
+                top_k_push(&candidates, b * vocab_size + t.ids[i], live[b].logp + logf(t.scores[i]));
+                continue;
+            }
+            for (size_t i = 0; i < t.count; ++i)
+                top_k_push(&candidates, b * vocab_size + t.ids[i], live[b].logp + logf(t.scores[i]));
+        }
+        top_k_sort(&candidates);
+
+        size_t survivors = 0;
+        for (size_t i = 0; i < candidates.count; ++i) {
+            Beam *parent = &live[candidates.ids[i] / vocab_size], *child = &next[survivors];
+            size_t id = candidates.ids[i] % vocab_size;
+            memcpy(child->ids, parent->ids, parent->len * sizeof(size_t));
+            child->len = parent->len;
+            child->ids[child->len++] = id;
+            child->logp = candidates.scores[i];
+            if (child->len == max_tokens || token_ends_line(id)) {
+                if (child->logp / child->len > best) {
+                    best = child->logp / child->len;
+                    memcpy(s->done.ids, child->ids, child->len * sizeof(size_t));
+                    s->done.len = child->len;
+                }
+                continue;
+            }
+            memcpy(child->xh, parent->xh, state_dim * sizeof(float));
+            memcpy(child->c, parent->c, m->hidden_dim * sizeof(float));
+            model_step(m, id, child->xh, s->z, child->c);
+            ++survivors;
+        }
+        Beam *swap = live;
+        live = next;
+        next = swap;
+        count = survivors;
+    }
+
+    memcpy(ids, s->done.ids, s->done.len * sizeof(size_t));
+    return s->done.len;
+}
+
+//
+// Predict next token given input string (BPE-encoded)
+//
+int rnn_predict(const char *input, char *output, size_t output_len) {
+    RnnSession *s = rnn_session_create(NULL);
+    if (s == NULL) return 1;
+    int status = rnn_session_append(s, input) || rnn_session_predict(s, output, output_len);
+    rnn_session_free(s);
+    return status;
+}
+
+//
+// Batched prediction over independent contexts. The contexts advance in
+// lockstep, longest first, so the ones still running at a step are the first
+// rows and each step is one GEMM over them, as is the output head at the
+// end. Wy and W are streamed once per batch instead of once per context.
+//
+#define RNN_BATCH_MAX 64
+#define RNN_GEMM_ROWS 2 // fewer rows than this are cheaper through vec_mat()
+
+typedef struct RnnRequest {
+    size_t *ids;              // stb_ds, BPE ids of the context
+    size_t pred;
+    struct timespec deadline; // CLOCK_MONOTONIC time its batch has to start by, see RnnServer
+    int done;
+    pthread_cond_t finished;
+    struct RnnRequest *next;
+} RnnRequest;
+
+typedef struct PredictBatch {
+    Tensor xh;      // [capacity][embedding_dim + hidden_dim]
+    Tensor z;       // [capacity][gates * hidden_dim]
+    Tensor c;       // [capacity][hidden_dim]
+    Tensor probs;   // [capacity][outputs of the head]
+    float *scratch; // see model_scratch()
+    size_t capacity;
+} PredictBatch;
+
+void predict_batch_free(PredictBatch *p) {
+    tensor_free(&p->xh);
+    tensor_free(&p->z);
+    tensor_free(&p->c);
+    tensor_free(&p->probs);
+    free(p->scratch); p->scratch = NULL;
+}
+
+int predict_batch_create(PredictBatch *p, const RnnModel *m, size_t capacity) {
+    *p = (PredictBatch){ .capacity = capacity };
+    if (tensor_create(&p->xh, capacity, m->embedding_dim + m->hidden_dim) > 0 ||
+        tensor_create(&p->z, capacity, m->W.col) > 0 ||
+        tensor_create(&p->c, capacity, m->hidden_dim) > 0 ||
+        tensor_create(&p->probs, capacity, m->Wy.col) > 0 ||
+        (p->scratch = vec_create(model_scratch(m))) == NULL) {
+        fprintf(stderr, "[ERROR] Failed to allocate a prediction batch\n");
+        predict_batch_free(p);
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Most probable next id after each of `count` <= capacity contexts. Leaves
+// `requests` sorted by decreasing length.
+//
+void predict_batch_run(PredictBatch *p, RnnModel *m, RnnRequest **requests, size_t count) {
+    size_t embedding_dim = m->embedding_dim;
+    for (size_t i = 1; i < count; ++i) {
+        RnnRequest *r = requests[i];
+        size_t j = i;
+        for (; j > 0 && arrlenu(requests[j - 1]->ids) < arrlenu(r->ids); --j)
+            requests[j] = requests[j - 1];
+        requests[j] = r;
+    }
+
+    Tensor xh_all = tensor_view(&p->xh, 0, count);
+    Tensor c_all = tensor_view(&p->c, 0, count);
+    tensor_zero(&xh_all);
+    tensor_zero(&c_all);
+    size_t active = count;
+    for (size_t t = 0;; ++t) {
+        while (active > 0 && arrlenu(requests[active - 1]->ids) <= t) --active;
+        if (active == 0) break;
+        Tensor xh = tensor_view(&p->xh, 0, active);
+        Tensor z = tensor_view(&p->z, 0, active);
+        for (size_t r = 0; r < active; ++r) {
+            size_t id = requests[r]->ids[t];
+            memcpy(tensor_row(&xh, r), tensor_row(&m->embedding, id < m->vocab_size ? id : SYM_UNK), embedding_dim * sizeof(float));
+            memcpy(tensor_row(&z, r), m->b, z.col * sizeof(float));
+        }
+        if (active < RNN_GEMM_ROWS) {
+            for (size_t r = 0; r < active; ++r)
+                vec_mat(tensor_row(&z, r), tensor_row(&xh, r), &m->W);
+        } else {
+            mat_mul(&z, &xh, &m->W);
+        }
+        for (size_t r = 0; r < active; ++r) {
+            float *c = tensor_row(&p->c, r);
+            cell_forward(m->cell, tensor_row(&z, r), c, c, tensor_row(&xh, r) + embedding_dim, m->hidden_dim);
+        }
+    }
+
+    Tensor hs = tensor_cols(&xh_all, embedding_dim, m->hidden_dim);
+    Tensor probs = tensor_view(&p->probs, 0, count);
+    for (size_t r = 0; r < count; ++r)
+        memcpy(tensor_row(&probs, r), m->by, probs.col * sizeof(float));
+    if (count < RNN_GEMM_ROWS) {
+        for (size_t r = 0; r < count; ++r)
+            vec_mat(tensor_row(&probs, r), tensor_row(&hs, r), &m->Wy);
+    } else {
+        mat_mul(&probs, &hs, &m->Wy);
+    }
+    for (size_t r = 0; r < count; ++r) {
+        float *row = tensor_row(&probs, r), score;
+        TopK top;
+        softmax(row, probs.col, row);
+        top_k_init(&top, 1, &requests[r]->pred, &score);
+        model_top_k_head(m, tensor_row(&hs, r), row, p->scratch, &top);
+        if (requests[r]->pred >= m->vocab_size) requests[r]->pred = 0;
+    }
+}
+
+//
+// Most probable next id after each of `count` texts into `preds`, on `model`
+// or the default model when that is NULL.
+//
+int rnn_predict_batch(RnnModel *model, const char **inputs, size_t count, size_t *preds) {
+    if (count == 0) return 0;
+    RnnModel *m = model;
+    if (m != NULL) model_retain(m);
+    else m = model_default();
+    if (m == NULL) return 1;
+
+    PredictBatch p;
+    RnnRequest *requests = calloc(count, sizeof(RnnRequest));
+    RnnRequest **batch = malloc(RNN_BATCH_MAX * sizeof(RnnRequest *));
+    if (!requests || !batch || predict_batch_create(&p, m, RNN_BATCH_MAX) > 0) {
+        free(requests);
+        free(batch);
+        model_release(m);
+        return 1;
+    }
+    for (size_t from = 0; from < count; from += RNN_BATCH_MAX) {
+        size_t n = count - from < RNN_BATCH_MAX ? count - from : RNN_BATCH_MAX;
+        for (size_t i = 0; i < n; ++i) {
+            size_t len = 0;
+            batch[i] = &requests[from + i];
+            batch[i]->ids = bpe_encode(inputs[from + i], strlen(inputs[from + i]), &len);
+        }
+        predict_batch_run(&p, m, batch, n);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        preds[i] = requests[i].pred;
+        arrfree(requests[i].ids);
+    }
+
+    predict_batch_free(&p);
+    free(requests);
+    free(batch);
+    model_release(m);
+    return 0;
+}
+
+//
+// Dynamic batching for concurrent callers of rnn_server_predict(). Requests
+// queue up and a worker takes up to `max_batch` of them at once, as soon as
+// there are that many or the oldest has waited `deadline_us`. Under light
+// load a request waits at most the deadline, under heavy load the batches
+// fill before it and nobody waits. Requests are encoded on the threads that
+// submit them, every worker runs its own batches.
+//
+typedef struct RnnServer RnnServer;
+
+typedef struct RnnServerWorker {
+    RnnServer *server;
+    pthread_t thread;
+    PredictBatch batch;
+    RnnRequest **requests; // [max_batch], the batch being run
+} RnnServerWorker;
+
+struct RnnServer {
+    RnnModel *model;
+    RnnServerWorker *workers;
+    size_t threads;
+    size_t max_batch;
+    size_t deadline_us;
+    pthread_mutex_t lock;
+    pthread_cond_t arrived;
+    RnnRequest *head; // oldest queued request
+    RnnRequest *tail;
+    size_t pending;
+    int stop;
+};
+
+int request_due(const RnnRequest *r) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > r->deadline.tv_sec || (now.tv_sec == r->deadline.tv_sec && now.tv_nsec >= r->deadline.tv_nsec);
+}
+
+void *server_worker(void *arg) {
+    RnnServerWorker *w = arg;
+    RnnServer *sv = w->server;
+    pthread_mutex_lock(&sv->lock);
+    for (;;) {
+        if (sv->head == NULL) {
+            if (sv->stop) break;
+            pthread_cond_wait(&sv->arrived, &sv->lock);
+            continue;
+        }
+        if (!sv->stop && sv->pending < sv->max_batch && !request_due(sv->head)) {
+            pthread_cond_timedwait(&sv->arrived, &sv->lock, &sv->head->deadline);
+            continue;
+        }
+
+        size_t count = 0;
+        for (; sv->head != NULL && count < sv->max_batch; sv->head = sv->head->next)
+            w->requests[count++] = sv->head;
+        if (sv->head == NULL) sv->tail = NULL;
+        else pthread_cond_signal(&sv->arrived);
+        sv->pending -= count;
+        pthread_mutex_unlock(&sv->lock);
+
+        predict_batch_run(&w->batch, sv->model, w->requests, count);
+
+        pthread_mutex_lock(&sv->lock);
+        for (size_t i = 0; i < count; ++i) {
+            w->requests[i]->done = 1;
+            pthread_cond_signal(&w->requests[i]->finished);
+        }
+    }
+    pthread_mutex_unlock(&sv->lock);
+    return NULL;
+}
+
+//
+// Answers what is still queued, then stops the workers.
+//
+void rnn_server_free(RnnServer *sv) {
+    if (sv == NULL) return;
+    pthread_mutex_lock(&sv->lock);
+    sv->stop = 1;
+    pthread_cond_broadcast(&sv->arrived);
+    pthread_mutex_unlock(&sv->lock);
+    for (size_t i = 0; i < sv->threads; ++i) {
+        pthread_join(sv->workers[i].thread, NULL);
+        predict_batch_free(&sv->workers[i].batch);
+        free(sv->workers[i].requests);
+    }
+    free(sv->workers);
+    pthread_cond_destroy(&sv->arrived);
+    pthread_mutex_destroy(&sv->lock);
+    model_release(sv->model);
+    free(sv);
+}
+
+//
+// Server on `model`, or on the default model when that is NULL, with
+// `threads` workers running batches of up to `max_batch` requests. Returns
+// NULL without a model.
+//
+RnnServer *rnn_server_create(RnnModel *model, size_t threads, size_t max_batch, size_t deadline_us) {
+    RnnModel *m = model;
+    if (m != NULL) model_retain(m);
+    else m = model_default();
+    if (m == NULL) return NULL;
+    if (threads == 0) threads = 1;
+
+    RnnServer *sv = calloc(1, sizeof(RnnServer));
+    RnnServerWorker *workers = calloc(threads, sizeof(RnnServerWorker));
+    if (sv == NULL || workers == NULL) {
+        free(sv);
+        free(workers);
+        model_release(m);
+        return NULL;
+    }
+    sv->model = m;
+    sv->workers = workers;
+    sv->max_batch = max_batch > 0 ? max_batch : RNN_BATCH_MAX;
+    sv->deadline_us = deadline_us;
+    //
+    // Deadlines are on the monotonic clock, steps of the wall clock neither
+    // stall queued requests nor flush them early
+    //
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&sv->lock, NULL);
+    pthread_cond_init(&sv->arrived, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (size_t i = 0; i < threads; ++i) {
+        RnnServerWorker *w = &workers[i];
+        w->server = sv;
+        w->requests = malloc(sv->max_batch * sizeof(RnnRequest *));
+        if (w->requests == NULL || predict_batch_create(&w->batch, m, sv->max_batch) > 0 ||
+            pthread_create(&w->thread, NULL, server_worker, w) != 0) {
+            fprintf(stderr, "[ERROR] Failed to start a prediction server worker\n");
+            predict_batch_free(&w->batch);
+            free(w->requests);
+            break;
+        }
+        sv->threads = i + 1;
+    }
+    if (sv->threads == 0) {
+        rnn_server_free(sv);
+        return NULL;
+    }
+    printf("[INFO] Serving predictions in batches of up to %zu on %zu threads, %zu us deadline\n",
+           sv->max_batch, sv->threads, sv->deadline_us);
+    return sv;
+}
+
+//
+// Write the id of the most probable next token after `input`, like
+// rnn_predict(), batched with whatever other threads ask for meanwhile.
+// Returns 0 on success, 1 when the request could not be queued, also once
+// the server is being freed.
+//
+int rnn_server_predict(RnnServer *sv, const char *input, char *output, size_t output_len) {
+    if (sv == NULL || sv->model == NULL || input == NULL || (output == NULL && output_len > 0)) {
+        fprintf(stderr, "[ERROR] Invalid prediction request\n");
+        return 1;
+    }
+    size_t len = 0;
+    RnnRequest r = { .ids = bpe_encode(input, strlen(input), &len) };
+    if (pthread_cond_init(&r.finished, NULL) != 0) {
+        arrfree(r.ids);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &r.deadline);
+    r.deadline.tv_sec += sv->deadline_us / 1000000;
+    r.deadline.tv_nsec += (long)(sv->deadline_us % 1000000) * 1000;
+    if (r.deadline.tv_nsec >= 1000000000) {
+        r.deadline.tv_sec += 1;
+        r.deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&sv->lock);
+    if (sv->stop) {
+        pthread_mutex_unlock(&sv->lock);
+        pthread_cond_destroy(&r.finished);
+        arrfree(r.ids);
+        fprintf(stderr, "[ERROR] The prediction server is stopping\n");
+        return 1;
+    }
+    if (sv->tail != NULL) sv->tail->next = &r;
+    else sv->head = &r;
+    sv->tail = &r;
+    ++sv->pending;
+    pthread_cond_signal(&sv->arrived);
+    while (!r.done)
+        pthread_cond_wait(&r.finished, &sv->lock);
+    pthread_mutex_unlock(&sv->lock);
 
-    free(h_prev); free(h_t); free(logits); free(probs); arrfree(ids);
+    pthread_cond_destroy(&r.finished);
+    arrfree(r.ids);
+    if (output_len > 0) snprintf(output, output_len, "%zu", r.pred);
     return 0;
 }
@@ -0,0 +1,920 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <immintrin.h>
+
+#include "tensor.h"
+
+//
+// Zeroed, aligned float buffer. Free with free().
+//
+float *vec_create(size_t len) {
+    size_t size = (len * sizeof(float) + TENSOR_ALIGN - 1) & ~(size_t)(TENSOR_ALIGN - 1);
+    float *v = aligned_alloc(TENSOR_ALIGN, size ? size : TENSOR_ALIGN);
+    if(v) memset(v, 0, size);
+    return v;
+}
+
+int tensor_create(Tensor *t, size_t row, size_t col) {
+    t->row = row;
+    t->col = col;
+    t->stride = (col + TENSOR_LANES - 1) & ~(TENSOR_LANES - 1);
+    t->data = vec_create(row * t->stride);
+    return t->data == NULL;
+}
+
+void tensor_rand(Tensor *t) {
+    for(size_t i = 0; i < t->row; ++i) {
+        for (size_t j = 0; j < t->col; ++j)
+            TENSOR_AT(t, i, j) = ((float)rand() / RAND_MAX - 0.5f) * 0.01f;
+    }
+}
+
+int tensor_rand_create(Tensor *t, size_t row, size_t col) {
+    if(tensor_create(t, row, col) > 0) return 1;
+    tensor_rand(t);
+    return 0;
+}
+
+float *tensor_row(Tensor *t, size_t i) {
+    return t->data + i * t->stride;
+}
+
+//
+// Rows [from, from + rows) of `t`, sharing its data.
+//
+Tensor tensor_view(Tensor *t, size_t from, size_t rows) {
+    Tensor v = *t;
+    v.data = tensor_row(t, from);
+    v.row = rows;
+    return v;
+}
+
+//
+// Columns [from, from + cols) of `t`, sharing its data. The view keeps the
+// stride of `t`, so it is not padded like a tensor of its own.
+//
+Tensor tensor_cols(Tensor *t, size_t from, size_t cols) {
+    Tensor v = *t;
+    v.data = t->data + from;
+    v.col = cols;
+    return v;
+}
+
+//
+// Floats a `row` x `col` tensor takes, padding included.
+//
+size_t tensor_len(size_t row, size_t col) {
+    return row * ((col + TENSOR_LANES - 1) & ~(TENSOR_LANES - 1));
+}
+
+//
+// Tensor over `data`, tensor_len() floats that the caller owns. Do not
+// tensor_free() it.
+//
+Tensor tensor_place(float *data, size_t row, size_t col) {
+    return (Tensor){ data, row, col, (col + TENSOR_LANES - 1) & ~(TENSOR_LANES - 1) };
+}
+
+void tensor_zero(Tensor *t) {
+    memset(t->data, 0, t->row * t->stride * sizeof(float));
+}
+
+void tensor_free(Tensor *t) {
+    free(t->data);
+    t->data = NULL;
+}
+
+//
+// Rows are stored packed, without their padding. Returns 0 on success.
+//
+int tensor_write(Tensor *t, FILE *f) {
+    if(t->stride == t->col)
+        return fwrite(t->data, sizeof(float), t->row * t->col, f) != t->row * t->col;
+    for (size_t i = 0; i < t->row; ++i)
+        if(fwrite(tensor_row(t, i), sizeof(float), t->col, f) != t->col) return 1;
+    return 0;
+}
+
+int tensor_read(Tensor *t, FILE *f) {
+    if(t->stride == t->col)
+        return fread(t->data, sizeof(float), t->row * t->col, f) != t->row * t->col;
+    for (size_t i = 0; i < t->row; ++i)
+        if(fread(tensor_row(t, i), sizeof(float), t->col, f) != t->col) return 1;
+    return 0;
+}
+
+//
+// Kernels
+//
+// Every kernel exists as a scalar fallback and as AVX2 and AVX-512 versions,
+// built with per-function target attributes so the library still runs on
+// any x86-64. vec_mat() sweeps W one row at a time over a tile of `y` that
+// stays in L1, four rows per pass. The GEMM works on KC x NC panels of B,
+// packed when enough rows of A read them, with a register-blocked micro
+// kernel (6 x 16 on AVX2, 8 x 32 on AVX-512), and reads A through a row and
+// a column step so that A^T B needs no transposed copy.
+//
+#define KERNEL_TILE 1024
+#define KERNEL_KC 256
+#define KERNEL_NC 512
+#define KERNEL_PACK_BLOCKS 8
+
+//
+// Left GEMM operand, element (i, k) is data[i * rs + k * cs].
+//
+typedef struct GemmLhs {
+    const float *data;
+    size_t rs;
+    size_t cs;
+    size_t k;
+} GemmLhs;
+
+typedef struct KernelTable {
+    const char *name;
+    void (*axpy)(float *y, float alpha, const float *x, size_t len);
+    float (*dot)(const float *x, const float *y, size_t len);
+    void (*vec_mat)(float *y, const float *x, const Tensor *w);
+    void (*mat_vec)(float *y, const Tensor *w, const float *x);
+    void (*mat_outer)(Tensor *w, float alpha, const float *x, const float *y);
+    void (*gemm)(Tensor *c, const GemmLhs *a, const Tensor *b);
+    void (*clip)(float *x, size_t len, float clip);
+    void (*sigmoid)(float *x, size_t len);
+    void (*tanh)(float *x, size_t len);
+    void (*momentum)(float *w, float *m, const float *g, size_t len, const OptimizerStep *s);
+    void (*adam)(float *w, float *m, float *v, const float *g, size_t len, const OptimizerStep *s);
+} KernelTable;
+
+size_t kernel_min(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+//
+// Scalar
+//
+void axpy_scalar(float *y, float alpha, const float *x, size_t len) {
+    for (size_t i = 0; i < len; ++i)
+        y[i] += alpha * x[i];
+}
+
+float dot_scalar(const float *x, const float *y, size_t len) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < len; ++i)
+        sum += x[i] * y[i];
+    return sum;
+}
+
+void vec_mat_scalar(float *y, const float *x, const Tensor *w) {
+    for (size_t j0 = 0; j0 < w->col; j0 += KERNEL_TILE) {
+        size_t j1 = kernel_min(j0 + KERNEL_TILE, w->col);
+        for (size_t i = 0; i < w->row; ++i) {
+            const float *r = w->data + i * w->stride;
+            for (size_t j = j0; j < j1; ++j)
+                y[j] += x[i] * r[j];
+        }
+    }
+}
+
+void mat_vec_scalar(float *y, const Tensor *w, const float *x) {
+    for (size_t i = 0; i < w->row; ++i)
+        y[i] += dot_scalar(w->data + i * w->stride, x, w->col);
+}
+
+void mat_outer_scalar(Tensor *w, float alpha, const float *x, const float *y) {
+    for (size_t i = 0; i < w->row; ++i)
+        axpy_scalar(w->data + i * w->stride, alpha * x[i], y, w->col);
+}
+
+void gemm_scalar(Tensor *c, const GemmLhs *a, const Tensor *b) {
+    for (size_t k0 = 0; k0 < a->k; k0 += KERNEL_KC) {
+        size_t k1 = kernel_min(k0 + KERNEL_KC, a->k);
+        for (size_t i = 0; i < c->row; ++i) {
+            float *cr = c->data + i * c->stride;
+            for (size_t k = k0; k < k1; ++k)
+                axpy_scalar(cr, a->data[i * a->rs + k * a->cs], b->data + k * b->stride, c->col);
+        }
+    }
+}
+
+void clip_scalar(float *x, size_t len, float clip) {
+    for (size_t i = 0; i < len; ++i)
+        x[i] = x[i] > clip ? clip : x[i] < -clip ? -clip : x[i];
+}
+
+void sigmoid_scalar(float *x, size_t len) {
+    for (size_t i = 0; i < len; ++i)
+        x[i] = 1.0f / (1.0f + expf(-x[i]));
+}
+
+void tanh_scalar(float *x, size_t len) {
+    for (size_t i = 0; i < len; ++i)
+        x[i] = tanhf(x[i]);
+}
+
+float step_grad_scalar(float g, const OptimizerStep *s) {
+    g *= s->scale;
+    return g > s->clip ? s->clip : g < -s->clip ? -s->clip : g;
+}
+
+void momentum_scalar(float *w, float *m, const float *g, size_t len, const OptimizerStep *s) {
+    for (size_t i = 0; i < len; ++i) {
+        m[i] = s->beta1 * m[i] + step_grad_scalar(g[i], s);
+        w[i] -= s->decay * w[i] + s->lr * m[i];
+    }
+}
+
+void adam_scalar(float *w, float *m, float *v, const float *g, size_t len, const OptimizerStep *s) {
+    for (size_t i = 0; i < len; ++i) {
+        float gi = step_grad_scalar(g[i], s);
+        m[i] = s->beta1 * m[i] + (1.0f - s->beta1) * gi;
+        v[i] = s->beta2 * v[i] + (1.0f - s->beta2) * gi * gi;
+        w[i] -= s->decay * w[i] + s->lr * m[i] / (sqrtf(v[i]) + s->eps);
+    }
+}
+
+const KernelTable kernels_scalar = {
+    "scalar", axpy_scalar, dot_scalar, vec_mat_scalar, mat_vec_scalar, mat_outer_scalar, gemm_scalar, clip_scalar,
+    sigmoid_scalar, tanh_scalar, momentum_scalar, adam_scalar,
+};
+
+//
+// GEMM panels. The SIMD GEMMs copy each KC x NC panel of B into a per-thread
+// buffer as column blocks of `width` floats, k-major and zero padded, so the
+// micro kernels read it sequentially instead of one row of B per page.
+// Partial blocks of C go through a small tile on the stack. The buffer is
+// freed when its thread exits.
+//
+// A copy costs about a pass over the panel, so with fewer than
+// KERNEL_PACK_BLOCKS row blocks of C to read it, as in the steps of a small
+// batch, full column blocks are read from B where it is and only the partial
+// one is packed.
+//
+// Without a buffer, a thread that failed to allocate one falls back to the
+// scalar GEMM.
+//
+pthread_key_t gemm_pack_key;
+pthread_once_t gemm_pack_once = PTHREAD_ONCE_INIT;
+
+void gemm_pack_init() {
+    pthread_key_create(&gemm_pack_key, free);
+}
+
+float *gemm_pack_buffer() {
+    pthread_once(&gemm_pack_once, gemm_pack_init);
+    float *pack = pthread_getspecific(gemm_pack_key);
+    if (pack == NULL) {
+        pack = aligned_alloc(TENSOR_ALIGN, KERNEL_KC * KERNEL_NC * sizeof(float));
+        if (pack == NULL) {
+            fprintf(stderr, "[ERROR] Failed to allocate a GEMM panel, using the scalar GEMM\n");
+            return NULL;
+        }
+        if (pthread_setspecific(gemm_pack_key, pack) != 0) {
+            free(pack);
+            fprintf(stderr, "[ERROR] Failed to keep a GEMM panel, using the scalar GEMM\n");
+            return NULL;
+        }
+    }
+    return pack;
+}
+
+void gemm_pack(float *pack, const Tensor *b, size_t k0, size_t k1, size_t j0, size_t j1, size_t width) {
+    for (size_t j = j0; j < j1; j += width) {
+        size_t n = kernel_min(width, j1 - j);
+        float *dst = pack + (j - j0) * (k1 - k0);
+        for (size_t k = k0; k < k1; ++k, dst += width) {
+            memcpy(dst, b->data + k * b->stride + j, n * sizeof(float));
+            if (n < width) memset(dst + n, 0, (width - n) * sizeof(float));
+        }
+    }
+}
+
+void gemm_tile_load(float *tile, size_t ldt, const float *c, size_t ldc, size_t rows, size_t n) {
+    for (size_t r = 0; r < rows; ++r) {
+        memcpy(tile + r * ldt, c + r * ldc, n * sizeof(float));
+        memset(tile + r * ldt + n, 0, (ldt - n) * sizeof(float));
+    }
+}
+
+void gemm_tile_store(const float *tile, size_t ldt, float *c, size_t ldc, size_t rows, size_t n) {
+    for (size_t r = 0; r < rows; ++r)
+        memcpy(c + r * ldc, tile + r * ldt, n * sizeof(float));
+}
+
+//
+// AVX2 + FMA
+//
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 float hsum_avx2(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+AVX2 void axpy_avx2(float *y, float alpha, const float *x, size_t len) {
+    __m256 a = _mm256_set1_ps(alpha);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+        _mm256_storeu_ps(y + i + 8, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8)));
+    }
+    for (; i + 8 <= len; i += 8)
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    for (; i < len; ++i)
+        y[i] += alpha * x[i];
+}
+
+AVX2 float dot_avx2(const float *x, const float *y, size_t len) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), s1);
+    }
+    for (; i + 8 <= len; i += 8)
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), s0);
+    float sum = hsum_avx2(_mm256_add_ps(s0, s1));
+    for (; i < len; ++i)
+        sum += x[i] * y[i];
+    return sum;
+}
+
+AVX2 void vec_mat_avx2(float *y, const float *x, const Tensor *w) {
+    size_t s = w->stride;
+    for (size_t j0 = 0; j0 < w->col; j0 += KERNEL_TILE) {
+        size_t j1 = kernel_min(j0 + KERNEL_TILE, w->col);
+        size_t jv = j0 + ((j1 - j0) & ~(size_t)7);
+        size_t i = 0;
+        for (; i + 4 <= w->row; i += 4) {
+            const float *r = w->data + i * s;
+            __m256 x0 = _mm256_set1_ps(x[i]), x1 = _mm256_set1_ps(x[i + 1]);
+            __m256 x2 = _mm256_set1_ps(x[i + 2]), x3 = _mm256_set1_ps(x[i + 3]);
+            for (size_t j = j0; j < jv; j += 8) {
+                __m256 acc = _mm256_loadu_ps(y + j);
+                acc = _mm256_fmadd_ps(x0, _mm256_loadu_ps(r + j), acc);
+                acc = _mm256_fmadd_ps(x1, _mm256_loadu_ps(r + s + j), acc);
+                acc = _mm256_fmadd_ps(x2, _mm256_loadu_ps(r + 2 * s + j), acc);
+                acc = _mm256_fmadd_ps(x3, _mm256_loadu_ps(r + 3 * s + j), acc);
+                _mm256_storeu_ps(y + j, acc);
+            }
+            for (size_t j = jv; j < j1; ++j)
+                y[j] += x[i] * r[j] + x[i + 1] * r[s + j] + x[i + 2] * r[2 * s + j] + x[i + 3] * r[3 * s + j];
+        }
+        for (; i < w->row; ++i)
+            axpy_avx2(y + j0, x[i], w->data + i * s + j0, j1 - j0);
+    }
+}
+
+AVX2 void mat_vec_avx2(float *y, const Tensor *w, const float *x) {
+    size_t s = w->stride, n = w->col, nv = n & ~(size_t)7;
+    size_t i = 0;
+    for (; i + 4 <= w->row; i += 4) {
+        const float *r = w->data + i * s;
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+        __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+        for (size_t j = 0; j < nv; j += 8) {
+            __m256 xv = _mm256_loadu_ps(x + j);
+            a0 = _mm256_fmadd_ps(_mm256_loadu_ps(r + j), xv, a0);
+            a1 = _mm256_fmadd_ps(_mm256_loadu_ps(r + s + j), xv, a1);
+            a2 = _mm256_fmadd_ps(_mm256_loadu_ps(r + 2 * s + j), xv, a2);
+            a3 = _mm256_fmadd_ps(_mm256_loadu_ps(r + 3 * s + j), xv, a3);
+        }
+        float s0 = hsum_avx2(a0), s1 = hsum_avx2(a1), s2 = hsum_avx2(a2), s3 = hsum_avx2(a3);
+        for (size_t j = nv; j < n; ++j) {
+            s0 += r[j] * x[j];
+            s1 += r[s + j] * x[j];
+            s2 += r[2 * s + j] * x[j];
+            s3 += r[3 * s + j] * x[j];
+        }
+        y[i] += s0; y[i + 1] += s1; y[i + 2] += s2; y[i + 3] += s3;
+    }
+    for (; i < w->row; ++i)
+        y[i] += dot_avx2(w->data + i * s, x, n);
+}
+
+AVX2 void mat_outer_avx2(Tensor *w, float alpha, const float *x, const float *y) {
+    for (size_t i = 0; i < w->row; ++i)
+        if (x[i] != 0.0f) axpy_avx2(w->data + i * w->stride, alpha * x[i], y, w->col);
+}
+
+//
+// C[0..R][0..16] += A[i..i+R][k0..k1] P[0..k1-k0][0..16], P a panel of B
+// with rows `ldp` apart, packed or in place. R <= 6 is a constant after inlining so the accumulators stay in
+// registers.
+//
+__attribute__((target("avx2,fma"), always_inline)) inline
+void gemm_block_avx2(float *c, size_t ldc, const GemmLhs *a, const float *p, size_t ldp, size_t i, size_t k0, size_t k1, const size_t R) {
+    __m256 acc[6][2];
+    #pragma GCC unroll 6
+    for (size_t r = 0; r < R; ++r) {
+        acc[r][0] = _mm256_loadu_ps(c + r * ldc);
+        acc[r][1] = _mm256_loadu_ps(c + r * ldc + 8);
+    }
+    const float *ak = a->data + i * a->rs + k0 * a->cs;
+    for (size_t k = k0; k < k1; ++k, ak += a->cs, p += ldp) {
+        __m256 b0 = _mm256_loadu_ps(p), b1 = _mm256_loadu_ps(p + 8);
+        #pragma GCC unroll 6
+        for (size_t r = 0; r < R; ++r) {
+            __m256 v = _mm256_broadcast_ss(ak + r * a->rs);
+            acc[r][0] = _mm256_fmadd_ps(v, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(v, b1, acc[r][1]);
+        }
+    }
+    #pragma GCC unroll 6
+    for (size_t r = 0; r < R; ++r) {
+        _mm256_storeu_ps(c + r * ldc, acc[r][0]);
+        _mm256_storeu_ps(c + r * ldc + 8, acc[r][1]);
+    }
+}
+
+AVX2 void gemm_rows_avx2(float *c, size_t ldc, const GemmLhs *a, const float *p, size_t ldp, size_t i, size_t k0, size_t k1, size_t rows) {
+    switch (rows) {
+    case 6: gemm_block_avx2(c, ldc, a, p, ldp, i, k0, k1, 6); break;
+    case 5: gemm_block_avx2(c, ldc, a, p, ldp, i, k0, k1, 5); break;
+    case 4: gemm_block_avx2(c, ldc, a, p, ldp, i, k0, k1, 4); break;
+    case 3: gemm_block_avx2(c, ldc, a, p, ldp, i, k0, k1, 3); break;
+    case 2: gemm_block_avx2(c, ldc, a, p, ldp, i, k0, k1, 2); break;
+    default: gemm_block_avx2(c, ldc, a, p, ldp, i, k0, k1, 1); break;
+    }
+}
+
+AVX2 void gemm_avx2(Tensor *c, const GemmLhs *a, const Tensor *b) {
+    float *pack = gemm_pack_buffer();
+    if (pack == NULL) {
+        gemm_scalar(c, a, b);
+        return;
+    }
+    for (size_t k0 = 0; k0 < a->k; k0 += KERNEL_KC) {
+        size_t k1 = kernel_min(k0 + KERNEL_KC, a->k);
+        for (size_t j0 = 0; j0 < c->col; j0 += KERNEL_NC) {
+            size_t j1 = kernel_min(j0 + KERNEL_NC, c->col);
+            int packed = c->row > KERNEL_PACK_BLOCKS * 6;
+            if (packed) gemm_pack(pack, b, k0, k1, j0, j1, 16);
+            for (size_t i = 0; i < c->row; i += 6) {
+                size_t rows = kernel_min(6, c->row - i);
+                for (size_t j = j0; j < j1; j += 16) {
+                    float *p = pack + (j - j0) * (k1 - k0);
+                    float *cij = c->data + i * c->stride + j;
+                    size_t n = kernel_min(16, j1 - j);
+                    if (n == 16) {
+                        if (packed) gemm_rows_avx2(cij, c->stride, a, p, 16, i, k0, k1, rows);
+                        else gemm_rows_avx2(cij, c->stride, a, b->data + k0 * b->stride + j, b->stride, i, k0, k1, rows);
+                    } else {
+                        float tile[6 * 16];
+                        if (!packed) gemm_pack(p, b, k0, k1, j, j1, 16);
+                        gemm_tile_load(tile, 16, cij, c->stride, rows, n);
+                        gemm_rows_avx2(tile, 16, a, p, 16, i, k0, k1, rows);
+                        gemm_tile_store(tile, 16, cij, c->stride, rows, n);
+                    }
+                }
+            }
+        }
+    }
+}
+
+AVX2 void clip_avx2(float *x, size_t len, float clip) {
+    __m256 hi = _mm256_set1_ps(clip), lo = _mm256_set1_ps(-clip);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+        _mm256_storeu_ps(x + i, _mm256_min_ps(hi, _mm256_max_ps(lo, _mm256_loadu_ps(x + i))));
+    for (; i < len; ++i)
+        x[i] = x[i] > clip ? clip : x[i] < -clip ? -clip : x[i];
+}
+
+//
+// exp(x) as 2^n e^r with |r| <= ln(2) / 2 and a degree 6 polynomial for e^r,
+// about 1 ulp. Inputs are clamped so 2^n stays a normal float.
+//
+AVX2 __m256 exp_avx2(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0f)), _mm256_set1_ps(88.0f));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+AVX2 __m256 sigmoid_ps_avx2(__m256 x) {
+    __m256 one = _mm256_set1_ps(1.0f);
+    return _mm256_div_ps(one, _mm256_add_ps(one, exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x))));
+}
+
+AVX2 void sigmoid_avx2(float *x, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+        _mm256_storeu_ps(x + i, sigmoid_ps_avx2(_mm256_loadu_ps(x + i)));
+    sigmoid_scalar(x + i, len - i);
+}
+
+//
+// tanh(x) = 2 sigmoid(2x) - 1
+//
+AVX2 void tanh_avx2(float *x, size_t len) {
+    __m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256 s = sigmoid_ps_avx2(_mm256_mul_ps(two, _mm256_loadu_ps(x + i)));
+        _mm256_storeu_ps(x + i, _mm256_fmsub_ps(two, s, one));
+    }
+    tanh_scalar(x + i, len - i);
+}
+
+AVX2 void momentum_avx2(float *w, float *m, const float *g, size_t len, const OptimizerStep *s) {
+    __m256 scale = _mm256_set1_ps(s->scale), hi = _mm256_set1_ps(s->clip), lo = _mm256_set1_ps(-s->clip);
+    __m256 beta1 = _mm256_set1_ps(s->beta1), lr = _mm256_set1_ps(s->lr), keep = _mm256_set1_ps(1.0f - s->decay);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256 gi = _mm256_min_ps(hi, _mm256_max_ps(lo, _mm256_mul_ps(scale, _mm256_loadu_ps(g + i))));
+        __m256 mi = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(m + i), gi);
+        _mm256_storeu_ps(m + i, mi);
+        _mm256_storeu_ps(w + i, _mm256_fnmadd_ps(lr, mi, _mm256_mul_ps(keep, _mm256_loadu_ps(w + i))));
+    }
+    momentum_scalar(w + i, m + i, g + i, len - i, s);
+}
+
+AVX2 void adam_avx2(float *w, float *m, float *v, const float *g, size_t len, const OptimizerStep *s) {
+    __m256 scale = _mm256_set1_ps(s->scale), hi = _mm256_set1_ps(s->clip), lo = _mm256_set1_ps(-s->clip);
+    __m256 beta1 = _mm256_set1_ps(s->beta1), beta2 = _mm256_set1_ps(s->beta2);
+    __m256 rest1 = _mm256_set1_ps(1.0f - s->beta1), rest2 = _mm256_set1_ps(1.0f - s->beta2);
+    __m256 lr = _mm256_set1_ps(s->lr), eps = _mm256_set1_ps(s->eps), keep = _mm256_set1_ps(1.0f - s->decay);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256 gi = _mm256_min_ps(hi, _mm256_max_ps(lo, _mm256_mul_ps(scale, _mm256_loadu_ps(g + i))));
+        __m256 mi = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(m + i), _mm256_mul_ps(rest1, gi));
+        __m256 vi = _mm256_fmadd_ps(beta2, _mm256_loadu_ps(v + i), _mm256_mul_ps(rest2, _mm256_mul_ps(gi, gi)));
+        _mm256_storeu_ps(m + i, mi);
+        _mm256_storeu_ps(v + i, vi);
+        __m256 step = _mm256_div_ps(mi, _mm256_add_ps(_mm256_sqrt_ps(vi), eps));
+        _mm256_storeu_ps(w + i, _mm256_fnmadd_ps(lr, step, _mm256_mul_ps(keep, _mm256_loadu_ps(w + i))));
+    }
+    adam_scalar(w + i, m + i, v + i, g + i, len - i, s);
+}
+
+const KernelTable kernels_avx2 = {
+    "avx2", axpy_avx2, dot_avx2, vec_mat_avx2, mat_vec_avx2, mat_outer_avx2, gemm_avx2, clip_avx2,
+    sigmoid_avx2, tanh_avx2, momentum_avx2, adam_avx2,
+};
+
+//
+// AVX-512, tails use masked loads and stores
+//
+#define AVX512 __attribute__((target("avx512f")))
+
+AVX512 __mmask16 tail_mask(size_t n) {
+    return (__mmask16)((1u << n) - 1);
+}
+
+AVX512 void axpy_avx512(float *y, float alpha, const float *x, size_t len) {
+    __m512 a = _mm512_set1_ps(alpha);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+        _mm512_storeu_ps(y + i + 16, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16)));
+    }
+    for (; i + 16 <= len; i += 16)
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    if (i < len) {
+        __mmask16 m = tail_mask(len - i);
+        __m512 v = _mm512_fmadd_ps(a, _mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i));
+        _mm512_mask_storeu_ps(y + i, m, v);
+    }
+}
+
+AVX512 float dot_avx512(const float *x, const float *y, size_t len) {
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), s0);
+        s1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), s1);
+    }
+    for (; i + 16 <= len; i += 16)
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), s0);
+    if (i < len) {
+        __mmask16 m = tail_mask(len - i);
+        s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i), s1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+}
+
+AVX512 void vec_mat_avx512(float *y, const float *x, const Tensor *w) {
+    size_t s = w->stride;
+    for (size_t j0 = 0; j0 < w->col; j0 += KERNEL_TILE) {
+        size_t j1 = kernel_min(j0 + KERNEL_TILE, w->col);
+        size_t i = 0;
+        for (; i + 4 <= w->row; i += 4) {
+            const float *r = w->data + i * s;
+            __m512 x0 = _mm512_set1_ps(x[i]), x1 = _mm512_set1_ps(x[i + 1]);
+            __m512 x2 = _mm512_set1_ps(x[i + 2]), x3 = _mm512_set1_ps(x[i + 3]);
+            for (size_t j = j0; j < j1; j += 16) {
+                __mmask16 m = j + 16 <= j1 ? 0xFFFF : tail_mask(j1 - j);
+                __m512 acc = _mm512_maskz_loadu_ps(m, y + j);
+                acc = _mm512_fmadd_ps(x0, _mm512_maskz_loadu_ps(m, r + j), acc);
+                acc = _mm512_fmadd_ps(x1, _mm512_maskz_loadu_ps(m, r + s + j), acc);
+                acc = _mm512_fmadd_ps(x2, _mm512_maskz_loadu_ps(m, r + 2 * s + j), acc);
+                acc = _mm512_fmadd_ps(x3, _mm512_maskz_loadu_ps(m, r + 3 * s + j), acc);
+                _mm512_mask_storeu_ps(y + j, m, acc);
+            }
+        }
+        for (; i < w->row; ++i)
+            axpy_avx512(y + j0, x[i], w->data + i * s + j0, j1 - j0);
+    }
+}
+
+AVX512 void mat_vec_avx512(float *y, const Tensor *w, const float *x) {
+    size_t s = w->stride, n = w->col;
+    size_t i = 0;
+    for (; i + 4 <= w->row; i += 4) {
+        const float *r = w->data + i * s;
+        __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps();
+        __m512 a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+        for (size_t j = 0; j < n; j += 16) {
+            __mmask16 m = j + 16 <= n ? 0xFFFF : tail_mask(n - j);
+            __m512 xv = _mm512_maskz_loadu_ps(m, x + j);
+            a0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, r + j), xv, a0);
+            a1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, r + s + j), xv, a1);
+            a2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, r + 2 * s + j), xv, a2);
+            a3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, r + 3 * s + j), xv, a3);
+        }
+        y[i] += _mm512_reduce_add_ps(a0);
+        y[i + 1] += _mm512_reduce_add_ps(a1);
+        y[i + 2] += _mm512_reduce_add_ps(a2);
+        y[i + 3] += _mm512_reduce_add_ps(a3);
+    }
+    for (; i < w->row; ++i)
+        y[i] += dot_avx512(w->data + i * s, x, n);
+}
+
+AVX512 void mat_outer_avx512(Tensor *w, float alpha, const float *x, const float *y) {
+    for (size_t i = 0; i < w->row; ++i)
+        if (x[i] != 0.0f) axpy_avx512(w->data + i * w->stride, alpha * x[i], y, w->col);
+}
+
+//
+// C[0..R][0..32] += A[i..i+R][k0..k1] P[0..k1-k0][0..32], R <= 8.
+//
+__attribute__((target("avx512f"), always_inline)) inline
+void gemm_block_avx512(float *c, size_t ldc, const GemmLhs *a, const float *p, size_t ldp, size_t i, size_t k0, size_t k1, const size_t R) {
+    __m512 acc[8][2];
+    #pragma GCC unroll 8
+    for (size_t r = 0; r < R; ++r) {
+        acc[r][0] = _mm512_loadu_ps(c + r * ldc);
+        acc[r][1] = _mm512_loadu_ps(c + r * ldc + 16);
+    }
+    const float *ak = a->data + i * a->rs + k0 * a->cs;
+    for (size_t k = k0; k < k1; ++k, ak += a->cs, p += ldp) {
+        __m512 b0 = _mm512_loadu_ps(p), b1 = _mm512_loadu_ps(p + 16);
+        #pragma GCC unroll 8
+        for (size_t r = 0; r < R; ++r) {
+            __m512 v = _mm512_set1_ps(ak[r * a->rs]);
+            acc[r][0] = _mm512_fmadd_ps(v, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_ps(v, b1, acc[r][1]);
+        }
+    }
+    #pragma GCC unroll 8
+    for (size_t r = 0; r < R; ++r) {
+        _mm512_storeu_ps(c + r * ldc, acc[r][0]);
+        _mm512_storeu_ps(c + r * ldc + 16, acc[r][1]);
+    }
+}
+
+AVX512 void gemm_rows_avx512(float *c, size_t ldc, const GemmLhs *a, const float *p, size_t ldp, size_t i, size_t k0, size_t k1, size_t rows) {
+    switch (rows) {
+    case 8: gemm_block_avx512(c, ldc, a, p, ldp, i, k0, k1, 8); break;
+    case 7: gemm_block_avx512(c, ldc, a, p, ldp, i, k0, k1, 7); break;
+    case 6: gemm_block_avx512(c, ldc, a, p, ldp, i, k0, k1, 6); break;
+    case 5: gemm_block_avx512(c, ldc, a, p, ldp, i, k0, k1, 5); break;
+    case 4: gemm_block_avx512(c, ldc, a, p, ldp, i, k0, k1, 4); break;
+    case 3: gemm_block_avx512(c, ldc, a, p, ldp, i, k0, k1, 3); break;
+    case 2: gemm_block_avx512(c, ldc, a, p, ldp, i, k0, k1, 2); break;
+    default: gemm_block_avx512(c, ldc, a, p, ldp, i, k0, k1, 1); break;
+    }
+}
+
+AVX512 void gemm_avx512(Tensor *c, const GemmLhs *a, const Tensor *b) {
+    float *pack = gemm_pack_buffer();
+    if (pack == NULL) {
+        gemm_scalar(c, a, b);
+        return;
+    }
+    for (size_t k0 = 0; k0 < a->k; k0 += KERNEL_KC) {
+        size_t k1 = kernel_min(k0 + KERNEL_KC, a->k);
+        for (size_t j0 = 0; j0 < c->col; j0 += KERNEL_NC) {
+            size_t j1 = kernel_min(j0 + KERNEL_NC, c->col);
+            int packed = c->row > KERNEL_PACK_BLOCKS * 8;
+            if (packed) gemm_pack(pack, b, k0, k1, j0, j1, 32);
+            for (size_t i = 0; i < c->row; i += 8) {
+                size_t rows = kernel_min(8, c->row - i);
+                for (size_t j = j0; j < j1; j += 32) {
+                    float *p = pack + (j - j0) * (k1 - k0);
+                    float *cij = c->data + i * c->stride + j;
+                    size_t n = kernel_min(32, j1 - j);
+                    if (n == 32) {
+                        if (packed) gemm_rows_avx512(cij, c->stride, a, p, 32, i, k0, k1, rows);
+                        else gemm_rows_avx512(cij, c->stride, a, b->data + k0 * b->stride + j, b->stride, i, k0, k1, rows);
+                    } else {
+                        float tile[8 * 32];
+                        if (!packed) gemm_pack(p, b, k0, k1, j, j1, 32);
+                        gemm_tile_load(tile, 32, cij, c->stride, rows, n);
+                        gemm_rows_avx512(tile, 32, a, p, 32, i, k0, k1, rows);
+                        gemm_tile_store(tile, 32, cij, c->stride, rows, n);
+                    }
+                }
+            }
+        }
+    }
+}
+
+AVX512 void clip_avx512(float *x, size_t len, float clip) {
+    __m512 hi = _mm512_set1_ps(clip), lo = _mm512_set1_ps(-clip);
+    for (size_t i = 0; i < len; i += 16) {
+        __mmask16 m = i + 16 <= len ? 0xFFFF : tail_mask(len - i);
+        _mm512_mask_storeu_ps(x + i, m, _mm512_min_ps(hi, _mm512_max_ps(lo, _mm512_maskz_loadu_ps(m, x + i))));
+    }
+}
+
+AVX512 __m512 exp_avx512(__m512 x) {
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-87.0f)), _mm512_set1_ps(88.0f));
+    __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), r);
+    __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+    p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+    return _mm512_scalef_ps(p, n);
+}
+
+AVX512 __m512 sigmoid_ps_avx512(__m512 x) {
+    __m512 one = _mm512_set1_ps(1.0f);
+    return _mm512_div_ps(one, _mm512_add_ps(one, exp_avx512(_mm512_sub_ps(_mm512_setzero_ps(), x))));
+}
+
+AVX512 void sigmoid_avx512(float *x, size_t len) {
+    for (size_t i = 0; i < len; i += 16) {
+        __mmask16 m = i + 16 <= len ? 0xFFFF : tail_mask(len - i);
+        _mm512_mask_storeu_ps(x + i, m, sigmoid_ps_avx512(_mm512_maskz_loadu_ps(m, x + i)));
+    }
+}
+
+AVX512 void tanh_avx512(float *x, size_t len) {
+    __m512 one = _mm512_set1_ps(1.0f), two = _mm512_set1_ps(2.0f);
+    for (size_t i = 0; i < len; i += 16) {
+        __mmask16 m = i + 16 <= len ? 0xFFFF : tail_mask(len - i);
+        __m512 s = sigmoid_ps_avx512(_mm512_mul_ps(two, _mm512_maskz_loadu_ps(m, x + i)));
+        _mm512_mask_storeu_ps(x + i, m, _mm512_fmsub_ps(two, s, one));
+    }
+}
+
+AVX512 void momentum_avx512(float *w, float *m, const float *g, size_t len, const OptimizerStep *s) {
+    __m512 scale = _mm512_set1_ps(s->scale), hi = _mm512_set1_ps(s->clip), lo = _mm512_set1_ps(-s->clip);
+    __m512 beta1 = _mm512_set1_ps(s->beta1), lr = _mm512_set1_ps(s->lr), keep = _mm512_set1_ps(1.0f - s->decay);
+    for (size_t i = 0; i < len; i += 16) {
+        __mmask16 k = i + 16 <= len ? 0xFFFF : tail_mask(len - i);
+        __m512 gi = _mm512_min_ps(hi, _mm512_max_ps(lo, _mm512_mul_ps(scale, _mm512_maskz_loadu_ps(k, g + i))));
+        __m512 mi = _mm512_fmadd_ps(beta1, _mm512_maskz_loadu_ps(k, m + i), gi);
+        _mm512_mask_storeu_ps(m + i, k, mi);
+        _mm512_mask_storeu_ps(w + i, k, _mm512_fnmadd_ps(lr, mi, _mm512_mul_ps(keep, _mm512_maskz_loadu_ps(k, w + i))));
+    }
+}
+
+AVX512 void adam_avx512(float *w, float *m, float *v, const float *g, size_t len, const OptimizerStep *s) {
+    __m512 scale = _mm512_set1_ps(s->scale), hi = _mm512_set1_ps(s->clip), lo = _mm512_set1_ps(-s->clip);
+    __m512 beta1 = _mm512_set1_ps(s->beta1), beta2 = _mm512_set1_ps(s->beta2);
+    __m512 rest1 = _mm512_set1_ps(1.0f - s->beta1), rest2 = _mm512_set1_ps(1.0f - s->beta2);
+    __m512 lr = _mm512_set1_ps(s->lr), eps = _mm512_set1_ps(s->eps), keep = _mm512_set1_ps(1.0f - s->decay);
+    for (size_t i = 0; i < len; i += 16) {
+        __mmask16 k = i + 16 <= len ? 0xFFFF : tail_mask(len - i);
+        __m512 gi = _mm512_min_ps(hi, _mm512_max_ps(lo, _mm512_mul_ps(scale, _mm512_maskz_loadu_ps(k, g + i))));
+        __m512 mi = _mm512_fmadd_ps(beta1, _mm512_maskz_loadu_ps(k, m + i), _mm512_mul_ps(rest1, gi));
+        __m512 vi = _mm512_fmadd_ps(beta2, _mm512_maskz_loadu_ps(k, v + i), _mm512_mul_ps(rest2, _mm512_mul_ps(gi, gi)));
+        _mm512_mask_storeu_ps(m + i, k, mi);
+        _mm512_mask_storeu_ps(v + i, k, vi);
+        __m512 step = _mm512_div_ps(mi, _mm512_add_ps(_mm512_sqrt_ps(vi), eps));
+        _mm512_mask_storeu_ps(w + i, k, _mm512_fnmadd_ps(lr, step, _mm512_mul_ps(keep, _mm512_maskz_loadu_ps(k, w + i))));
+    }
+}
+
+const KernelTable kernels_avx512 = {
+    "avx512", axpy_avx512, dot_avx512, vec_mat_avx512, mat_vec_avx512, mat_outer_avx512, gemm_avx512, clip_avx512,
+    sigmoid_avx512, tanh_avx512, momentum_avx512, adam_avx512,
+};
+
+//
+// Dispatch. Set JIRAIYA_SCALAR in the environment to force the fallback.
+//
+const KernelTable *kernels = &kernels_scalar;
+pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+void kernels_init() {
+    __builtin_cpu_init();
+    if (getenv("JIRAIYA_SCALAR") != NULL)
+        kernels = &kernels_scalar;
+    else if (__builtin_cpu_supports("avx512f"))
+        kernels = &kernels_avx512;
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        kernels = &kernels_avx2;
+}
+
+const KernelTable *kernel_table() {
+    pthread_once(&kernels_once, kernels_init);
+    return kernels;
+}
+
+const char *kernel_name() {
+    return kernel_table()->name;
+}
+
+void vec_axpy(float *y, float alpha, const float *x, size_t len) {
+    kernel_table()->axpy(y, alpha, x, len);
+}
+
+float vec_dot(const float *x, const float *y, size_t len) {
+    return kernel_table()->dot(x, y, len);
+}
+
+void vec_clip(float *x, size_t len, float clip) {
+    kernel_table()->clip(x, len, clip);
+}
+
+void vec_sigmoid(float *x, size_t len) {
+    kernel_table()->sigmoid(x, len);
+}
+
+void vec_tanh(float *x, size_t len) {
+    kernel_table()->tanh(x, len);
+}
+
+void vec_momentum(float *w, float *m, const float *g, size_t len, const OptimizerStep *s) {
+    kernel_table()->momentum(w, m, g, len, s);
+}
+
+void vec_adam(float *w, float *m, float *v, const float *g, size_t len, const OptimizerStep *s) {
+    kernel_table()->adam(w, m, v, g, len, s);
+}
+
+void vec_mat(float *y, const float *x, const Tensor *w) {
+    kernel_table()->vec_mat(y, x, w);
+}
+
+void mat_vec(float *y, const Tensor *w, const float *x) {
+    kernel_table()->mat_vec(y, w, x);
+}
+
+void mat_outer(Tensor *w, float alpha, const float *x, const float *y) {
+    kernel_table()->mat_outer(w, alpha, x, y);
+}
+
+void mat_mul(Tensor *c, const Tensor *a, const Tensor *b) {
+    GemmLhs lhs = { a->data, a->stride, 1, a->col };
+    kernel_table()->gemm(c, &lhs, b);
+}
+
+void mat_mul_tn(Tensor *c, const Tensor *a, const Tensor *b) {
+    GemmLhs lhs = { a->data, 1, a->stride, a->row };
+    kernel_table()->gemm(c, &lhs, b);
+}
+
+//
+// A B^T is built on mat_vec(). A KERNEL_TILE wide slice of KERNEL_NT rows of
+// B stays in L2 while every row of A is dotted against it, which suits a
+// few rows of A. For many, transpose B once and use mat_mul().
+//
+#define KERNEL_NT 16
+
+void mat_mul_nt(Tensor *c, const Tensor *a, const Tensor *b) {
+    const KernelTable *k = kernel_table();
+    for (size_t k0 = 0; k0 < b->col; k0 += KERNEL_TILE) {
+        for (size_t j0 = 0; j0 < b->row; j0 += KERNEL_NT) {
+            Tensor panel = *b;
+            panel.data = b->data + j0 * b->stride + k0;
+            panel.row = kernel_min(KERNEL_NT, b->row - j0);
+            panel.col = kernel_min(KERNEL_TILE, b->col - k0);
+            for (size_t i = 0; i < c->row; ++i)
+                k->mat_vec(c->data + i * c->stride + j0, &panel, a->data + i * a->stride + k0);
+        }
+    }
+}
+
+//
+// dst = src^T, `dst` must already have the transposed shape. Works on 16 x 16
+// blocks so both sides are touched a cache line at a time.
+//
+void tensor_transpose(Tensor *dst, Tensor *src) {
+    for (size_t i0 = 0; i0 < src->row; i0 += 16)
+        for (size_t j0 = 0; j0 < src->col; j0 += 16)
+            for (size_t i = i0; i < kernel_min(i0 + 16, src->row); ++i)
+                for (size_t j = j0; j < kernel_min(j0 + 16, src->col); ++j)
+                    TENSOR_AT(dst, j, i) = TENSOR_AT(src, i, j);
+}
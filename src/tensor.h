@@ -0,0 +1,74 @@
+#ifndef TENSOR_H
+#define TENSOR_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+//
+// Row-major float tensor in one 64-byte aligned block. Rows are padded to
+// `stride` floats so each of them starts on a cache line.
+//
+typedef struct Tensor {
+    float *data;
+    size_t row;
+    size_t col;
+    size_t stride;
+} Tensor;
+
+#define TENSOR_ALIGN 64
+#define TENSOR_LANES (TENSOR_ALIGN / sizeof(float))
+
+#define TENSOR_AT(t, i, j) ((t)->data[(i) * (t)->stride + (j)])
+
+extern float *vec_create(size_t len);
+extern int tensor_create(Tensor *t, size_t row, size_t col);
+extern void tensor_rand(Tensor *t);
+extern int tensor_rand_create(Tensor *t, size_t row, size_t col);
+extern float *tensor_row(Tensor *t, size_t i);
+extern Tensor tensor_view(Tensor *t, size_t from, size_t rows);
+extern Tensor tensor_cols(Tensor *t, size_t from, size_t cols);
+extern size_t tensor_len(size_t row, size_t col);
+extern Tensor tensor_place(float *data, size_t row, size_t col);
+extern void tensor_zero(Tensor *t);
+extern void tensor_transpose(Tensor *dst, Tensor *src);
+extern void tensor_free(Tensor *t);
+extern int tensor_write(Tensor *t, FILE *f);
+extern int tensor_read(Tensor *t, FILE *f);
+
+//
+// Kernels, picked once for the CPU they run on. Everything accumulates into
+// its output, the caller zeroes or seeds it.
+//
+extern const char *kernel_name();
+extern void vec_axpy(float *y, float alpha, const float *x, size_t len);          // y += alpha x
+extern float vec_dot(const float *x, const float *y, size_t len);
+extern void vec_clip(float *x, size_t len, float clip);                           // x = clamp(x, -clip, clip)
+extern void vec_sigmoid(float *x, size_t len);                                    // x = 1 / (1 + e^-x)
+extern void vec_tanh(float *x, size_t len);                                       // x = tanh(x)
+extern void vec_mat(float *y, const float *x, const Tensor *w);                   // y += x W
+extern void mat_vec(float *y, const Tensor *w, const float *x);                   // y += W x
+extern void mat_outer(Tensor *w, float alpha, const float *x, const float *y);    // W += alpha x y^T
+extern void mat_mul(Tensor *c, const Tensor *a, const Tensor *b);                 // C += A B
+extern void mat_mul_tn(Tensor *c, const Tensor *a, const Tensor *b);              // C += A^T B
+extern void mat_mul_nt(Tensor *c, const Tensor *a, const Tensor *b);              // C += A B^T
+
+//
+// Fused optimizer steps, one pass over the parameters, their gradients and
+// moments. The gradient used is `scale` g clipped to [-clip, clip], and every
+// step also takes `decay` w off the parameters. The learning rate and epsilon
+// of Adam come with its bias correction folded in.
+//
+typedef struct OptimizerStep {
+    float lr;
+    float scale;
+    float clip;
+    float beta1;
+    float beta2;
+    float eps;
+    float decay;
+} OptimizerStep;
+
+extern void vec_momentum(float *w, float *m, const float *g, size_t len, const OptimizerStep *s);        // m = beta1 m + g, w -= lr m
+extern void vec_adam(float *w, float *m, float *v, const float *g, size_t len, const OptimizerStep *s);  // w -= lr m / (sqrt(v) + eps)
+
+#endif // TENSOR_H
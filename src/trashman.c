@@ -3,6 +3,13 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "tree_sitter/api.h"
 #include "tree-sitter-javascript.h"
@@ -17,270 +24,986 @@ typedef struct StringChanges {
 	char text[32];
 } StringChanges;
 
-typedef struct Variable {
-    char *original_name;
-    char *new_name;
-    struct Variable *next;
-} Variable;
-
-typedef struct Scope {
-    Variable *variables;
-    struct Scope *parent;
-} Scope;
-
-
-size_t var_count = 0, item_counter = 0;
-Pair **global_pairs = NULL;
-Item **global_items = NULL;
-
-size_t tokens_equal(stb_lexer a, stb_lexer b) {
-	if(a.token == b.token) {
-		switch(a.token) {
-		case CLEX_id:
-		case CLEX_dqstring:
-		case CLEX_sqstring:
-			return strcmp(a.string, b.string) == 0;
-		case CLEX_intlit:
-			return a.int_number == b.int_number;
-		case CLEX_floatlit:
-			return a.real_number == b.real_number;
-		default:
-			return 1;
-		}
+
+SymbolTable global_symbols = {0};
+MergeTable global_merges = {0};
+DecodeTable global_decode = {0};
+
+//
+// Symbol table
+//
+
+uint32_t sym_hash(int token, const char *text, size_t len) {
+	uint32_t h = 2166136261u ^ (uint32_t)token;
+	h *= 16777619u;
+	for(size_t i = 0; i < len; ++i) {
+		h ^= (unsigned char)text[i];
+		h *= 16777619u;
 	}
-	return 0;
+	return h;
 }
 
-int items_equal(Item *a, Item *b) {
-	if (a == NULL || b == NULL) {
-		assert(1);
+//
+// Returns the slot holding the lexeme, or the empty slot where it belongs.
+//
+size_t sym_slot(SymbolTable *t, int token, const char *text, size_t len) {
+	size_t mask = t->slot_count - 1;
+	size_t i = sym_hash(token, text, len) & mask;
+	while(t->slots[i] != SYM_NONE) {
+		SymbolInfo *s = &t->syms[t->slots[i]];
+		if(s->token == token && s->len == len && memcmp(t->strings + s->offset, text, len) == 0)
+			break;
+		i = (i + 1) & mask;
 	}
+	return i;
+}
 
-	if(a->left && b->left && a->right && b->right)
-		return a->id == b->id;
+//
+// Copy a table loaded with bpe_load() out of the mapping before writing to it.
+//
+void sym_own(SymbolTable *t) {
+	if(!t->mapped) return;
+
+	SymbolInfo *syms = NULL;
+	char *strings = NULL;
+	Symbol *slots = NULL;
+	memcpy(arraddnptr(syms, t->count), t->syms, t->count * sizeof(SymbolInfo));
+	memcpy(arraddnptr(strings, t->strings_len), t->strings, t->strings_len);
+	memcpy(arraddnptr(slots, t->slot_count), t->slots, t->slot_count * sizeof(Symbol));
+
+	t->syms = syms;
+	t->strings = strings;
+	t->slots = slots;
+	t->mapped = 0;
+}
 
-	if(!a->left && !b->left && !a->right && !b->right)
-		return tokens_equal(a->value, b->value);
+void sym_grow(SymbolTable *t) {
+	size_t cap = t->slot_count ? t->slot_count * 2 : 1024;
+	arrsetlen(t->slots, cap);
+	memset(t->slots, 0xFF, cap * sizeof(Symbol));
+	t->slot_count = cap;
+
+	for(size_t i = 0; i < t->count; ++i) {
+		SymbolInfo *s = &t->syms[i];
+		if(s->left != SYM_NONE) continue;
+		size_t slot = sym_slot(t, s->token, t->strings + s->offset, s->len);
+		t->slots[slot] = (Symbol)i;
+	}
+}
 
-	return 0;
+Symbol sym_lookup(SymbolTable *t, int token, const char *text, size_t len) {
+	if(t->slot_count == 0) return SYM_UNK;
+	Symbol s = t->slots[sym_slot(t, token, text, len)];
+	return s == SYM_NONE ? SYM_UNK : s;
 }
 
-void copy_into_item(Item *a, stb_lexer *b) {
-	a->value.token = b->token;
-	switch(b->token) {
-	case CLEX_id:
-	case CLEX_dqstring:
-	case CLEX_sqstring:
-		a->value.string =  malloc(strlen(b->string) + 1);
-		strcpy(a->value.string, b->string);
-		break;
-	case CLEX_intlit:
-		a->value.int_number = b->int_number;
-		break;
-	case CLEX_floatlit:
-		a->value.real_number = b->real_number;
-		break;
+Symbol sym_intern(SymbolTable *t, int token, const char *text, size_t len) {
+	sym_own(t);
+
+	if(t->count == 0) {
+		SymbolInfo unk = { 0, 0, 5, SYM_NONE, SYM_NONE };
+		arrput(t->syms, unk);
+		memcpy(arraddnptr(t->strings, 6), "<UNK>", 6);
+		t->count = 1;
+		t->strings_len = 6;
+		t->used = 1;
 	}
+
+	if((t->used + 1) * 2 > t->slot_count)
+		sym_grow(t);
+
+	size_t slot = sym_slot(t, token, text, len);
+	if(t->slots[slot] != SYM_NONE)
+		return t->slots[slot];
+
+	SymbolInfo s = { token, (uint32_t)t->strings_len, (uint32_t)len, SYM_NONE, SYM_NONE };
+	char *dst = arraddnptr(t->strings, len + 1);
+	memcpy(dst, text, len);
+	dst[len] = '\0';
+	t->strings_len += len + 1;
+
+	Symbol id = (Symbol)t->count++;
+	arrput(t->syms, s);
+	t->slots[slot] = id;
+	t->used++;
+	return id;
+}
+
+//
+// Merged symbols are not indexed here, they are looked up by their pair.
+//
+Symbol sym_merge(SymbolTable *t, Symbol left, Symbol right) {
+	sym_own(t);
+
+	SymbolInfo s = { 0, 0, 0, left, right };
+	Symbol id = (Symbol)t->count++;
+	arrput(t->syms, s);
+	return id;
+}
+
+//
+// NOTE: The pointer is only valid until the next symbol is interned.
+//
+const char* sym_text(SymbolTable *t, Symbol s) {
+	if(s >= t->count || t->syms[s].left != SYM_NONE) return NULL;
+	return t->strings + t->syms[s].offset;
 }
 
 //
-// NOTE: Left and right should be freed manually.
+// Number of lexemes `s` expands to.
 //
-void free_item(Item *itm) {
-	assert(itm != NULL);
-	if(itm->value.string != NULL)
-		free(itm->value.string);
-	free(itm);
+size_t sym_leaves(SymbolTable *t, Symbol s) {
+	if(s >= t->count || t->syms[s].left == SYM_NONE) return 1;
+	return sym_leaves(t, t->syms[s].left) + sym_leaves(t, t->syms[s].right);
 }
 
-void print_item(Item *itm) {
-	if(itm->left != NULL && itm->right != NULL) {
-		print_item(itm->left);
+void sym_free(SymbolTable *t) {
+	if(!t->mapped) {
+		arrfree(t->syms);
+		arrfree(t->strings);
+		arrfree(t->slots);
+	}
+	memset(t, 0, sizeof(*t));
+}
+
+//
+// Lex a buffer into symbols. Without `intern`, lexemes missing from the
+// table become SYM_UNK. With `ends`, it receives the offset just past every
+// lexeme in `input`, as an stb_ds array.
+//
+Symbol *bpe_lex_ends(SymbolTable *t, const char *input, size_t len, int intern, size_t **ends) {
+	Symbol *syms = NULL;
+
+	stb_lexer lexer;
+	char string_store[1028];
+	stb_c_lexer_init(&lexer, input, input + len, string_store, sizeof(string_store));
+
+	while(stb_c_lexer_get_token(&lexer)) {
+		if(lexer.token == CLEX_parse_error) {
+			fprintf(stderr, "[ERROR] Parse error.\n");
+			continue;
+		}
+
+		const char *text = lexer.where_firstchar;
+		size_t text_len = lexer.where_lastchar - lexer.where_firstchar + 1;
+		arrput(syms, intern
+			   ? sym_intern(t, (int)lexer.token, text, text_len)
+			   : sym_lookup(t, (int)lexer.token, text, text_len));
+		if(ends != NULL) arrput(*ends, (size_t)(lexer.where_lastchar - input + 1));
+	}
+	return syms;
+}
+
+Symbol *bpe_lex(SymbolTable *t, const char *input, size_t len, int intern) {
+	return bpe_lex_ends(t, input, len, intern, NULL);
+}
+
+void print_symbol(SymbolTable *t, Symbol s) {
+	SymbolInfo *info = &t->syms[s];
+	if(info->left != SYM_NONE) {
+		print_symbol(t, info->left);
 		printf(" ");
-		print_item(itm->right);
+		print_symbol(t, info->right);
 	} else {
-		switch(itm->value.token) {
-		case CLEX_id:
-		case CLEX_dqstring:
-		case CLEX_sqstring:
-			printf("%s", itm->value.string);
-			break;
-		case CLEX_intlit:
-			printf("%ld", itm->value.int_number);
-			break;
-		case CLEX_floatlit:
-			printf("%lf", itm->value.real_number);
+		printf("%s", t->strings + info->offset);
+	}
+}
+
+//
+// Merge rules
+//
+// A rule's position in `pairs` is its rank. The index maps (left, right) to
+// that rank, and keeps the first rank of every left symbol for next-token
+// lookups.
+//
+
+uint32_t merge_hash(Symbol a, Symbol b) {
+	uint64_t k = ((uint64_t)a << 32 | b) * 0x9E3779B97F4A7C15ull;
+	return (uint32_t)(k >> 32);
+}
+
+size_t merge_slot(MergeTable *m, uint32_t *slots, Symbol a, Symbol b, int by_left) {
+	size_t mask = m->slot_count - 1;
+	size_t i = merge_hash(a, by_left ? SYM_NONE : b) & mask;
+	while(slots[i] != MERGE_NONE) {
+		Pair *p = &m->pairs[slots[i]];
+		if(p->a == a && (by_left || p->b == b))
 			break;
-		default:
-			if(itm->value.token < 256)
-				printf("%c", (char)itm->value.token);
-			else
-				printf("%ld", itm->value.token);
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+void merge_index(MergeTable *m, uint32_t rank) {
+	Pair *p = &m->pairs[rank];
+	size_t slot = merge_slot(m, m->pair_slots, p->a, p->b, 0);
+	if(m->pair_slots[slot] == MERGE_NONE)
+		m->pair_slots[slot] = rank;
+
+	slot = merge_slot(m, m->left_slots, p->a, p->b, 1);
+	if(m->left_slots[slot] == MERGE_NONE)
+		m->left_slots[slot] = rank;
+}
+
+void merge_rebuild(MergeTable *m) {
+	size_t cap = 1024;
+	while(cap < (m->count + 1) * 2) cap *= 2;
+
+	arrsetlen(m->pair_slots, cap);
+	arrsetlen(m->left_slots, cap);
+	memset(m->pair_slots, 0xFF, cap * sizeof(uint32_t));
+	memset(m->left_slots, 0xFF, cap * sizeof(uint32_t));
+	m->slot_count = cap;
+
+	for(size_t i = 0; i < m->count; ++i)
+		merge_index(m, (uint32_t)i);
+}
+
+void merge_own(MergeTable *m) {
+	if(!m->mapped) return;
+
+	Pair *pairs = NULL;
+	uint32_t *pair_slots = NULL, *left_slots = NULL;
+	memcpy(arraddnptr(pairs, m->count), m->pairs, m->count * sizeof(Pair));
+	memcpy(arraddnptr(pair_slots, m->slot_count), m->pair_slots, m->slot_count * sizeof(uint32_t));
+	memcpy(arraddnptr(left_slots, m->slot_count), m->left_slots, m->slot_count * sizeof(uint32_t));
+
+	m->pairs = pairs;
+	m->pair_slots = pair_slots;
+	m->left_slots = left_slots;
+	m->mapped = 0;
+}
+
+//
+// Append a rule, returns its rank.
+//
+uint32_t merge_add(MergeTable *m, Symbol a, Symbol b, Symbol item_id) {
+	merge_own(m);
+
+	Pair p = { a, b, item_id };
+	uint32_t rank = (uint32_t)m->count++;
+	arrput(m->pairs, p);
+
+	if(m->count * 2 > m->slot_count)
+		merge_rebuild(m);
+	else
+		merge_index(m, rank);
+	return rank;
+}
+
+uint32_t merge_find(MergeTable *m, Symbol a, Symbol b) {
+	if(m->slot_count == 0) return MERGE_NONE;
+	return m->pair_slots[merge_slot(m, m->pair_slots, a, b, 0)];
+}
+
+uint32_t merge_find_left(MergeTable *m, Symbol a) {
+	if(m->slot_count == 0) return MERGE_NONE;
+	return m->left_slots[merge_slot(m, m->left_slots, a, SYM_NONE, 1)];
+}
+
+void merge_free(MergeTable *m) {
+	if(!m->mapped) {
+		arrfree(m->pairs);
+		arrfree(m->pair_slots);
+		arrfree(m->left_slots);
+	}
+	memset(m, 0, sizeof(*m));
+}
+
+//
+// Decode table
+//
+// Surface text of every id, merged ids expanded to their lexemes joined by
+// spaces. Built whenever the tables change and read-only afterwards, so
+// decoding is a lookup and safe from any thread.
+//
+
+void decode_free(DecodeTable *d) {
+	arrfree(d->offsets);
+	arrfree(d->text);
+	d->count = 0;
+}
+
+void decode_build(DecodeTable *d, SymbolTable *t) {
+	decode_free(d);
+	arrsetlen(d->offsets, t->count + 1);
+
+	for(size_t i = 0; i < t->count; ++i) {
+		SymbolInfo *s = &t->syms[i];
+		d->offsets[i] = (uint32_t)arrlenu(d->text);
+
+		//
+		// NOTE: Children always have smaller ids, they are already decoded.
+		//
+		if(s->left == SYM_NONE) {
+			memcpy(arraddnptr(d->text, s->len), t->strings + s->offset, s->len);
+		} else {
+			uint32_t l = d->offsets[s->left], r = d->offsets[s->right];
+			size_t l_len = d->offsets[s->left + 1] - l - 1;
+			size_t r_len = d->offsets[s->right + 1] - r - 1;
+			char *dst = arraddnptr(d->text, l_len + 1 + r_len);
+			memcpy(dst, d->text + l, l_len);
+			dst[l_len] = ' ';
+			memcpy(dst + l_len + 1, d->text + r, r_len);
+		}
+		arrput(d->text, '\0');
+	}
+	d->offsets[t->count] = (uint32_t)arrlenu(d->text);
+	d->count = t->count;
+}
+
+const char* decode_text(DecodeTable *d, size_t id) {
+	if(id >= d->count) return "<UNK>";
+	return d->text + d->offsets[id];
+}
+
+//
+// Write the ids separated by spaces into `out`, truncating to `out_len`.
+// Returns the full length like snprintf().
+//
+size_t decode_ids(DecodeTable *d, const size_t *ids, size_t count, char *out, size_t out_len) {
+	size_t len = 0;
+	for(size_t i = 0; i < count; ++i) {
+		const char *text = decode_text(d, ids[i]);
+		size_t n = ids[i] < d->count ? d->offsets[ids[i] + 1] - d->offsets[ids[i]] - 1 : strlen(text);
+
+		if(i > 0) {
+			if(len + 1 < out_len) out[len] = ' ';
+			++len;
+		}
+		if(len < out_len) {
+			size_t room = out_len - len - 1;
+			memcpy(out + len, text, n < room ? n : room);
+		}
+		len += n;
+	}
+	if(out_len > 0) out[len < out_len ? len : out_len - 1] = '\0';
+	return len;
+}
+
+void *bpe_mapping = NULL;
+size_t bpe_mapping_size = 0;
+
+//
+// Drop the current tables and the mapping they may point into.
+//
+void bpe_reset() {
+	sym_free(&global_symbols);
+	merge_free(&global_merges);
+	decode_free(&global_decode);
+
+	if(bpe_mapping != NULL) {
+		munmap(bpe_mapping, bpe_mapping_size);
+		bpe_mapping = NULL;
+		bpe_mapping_size = 0;
+	}
+}
+
+//
+// Variable renaming.
+//
+// Node kinds are resolved to symbol ids once, then every node costs one
+// table lookup. Bindings live in a per-file arena: each name is interned once
+// and points at its innermost binding, which remembers the one it shadows,
+// so lookups are O(1) and leaving a scope just unwinds its bindings.
+//
+enum {
+	RENAME_OTHER = 0,
+	RENAME_SCOPE,
+	RENAME_DECLARATION,
+	RENAME_DECLARATOR,
+	RENAME_IDENTIFIER,
+};
+
+uint8_t *rename_kinds = NULL; // TSSymbol -> RENAME_*
+uint32_t rename_kind_count = 0;
+pthread_once_t rename_kinds_once = PTHREAD_ONCE_INIT;
+
+void rename_kind_set(const TSLanguage *lang, const char *name, uint8_t kind) {
+	TSSymbol sym = ts_language_symbol_for_name(lang, name, strlen(name), true);
+	if(sym != 0 && sym < rename_kind_count)
+		rename_kinds[sym] = kind;
+}
+
+void rename_kinds_init() {
+	const TSLanguage *lang = tree_sitter_javascript();
+	rename_kind_count = ts_language_symbol_count(lang);
+	rename_kinds = calloc(rename_kind_count, 1);
+
+	rename_kind_set(lang, "statement_block", RENAME_SCOPE);
+	rename_kind_set(lang, "function_declaration", RENAME_SCOPE);
+	rename_kind_set(lang, "method_definition", RENAME_SCOPE);
+	rename_kind_set(lang, "class_body", RENAME_SCOPE);
+	rename_kind_set(lang, "for_statement", RENAME_SCOPE);
+	rename_kind_set(lang, "while_statement", RENAME_SCOPE);
+	rename_kind_set(lang, "if_statement", RENAME_SCOPE);
+	rename_kind_set(lang, "lexical_declaration", RENAME_DECLARATION);
+	rename_kind_set(lang, "variable_declaration", RENAME_DECLARATION);
+	rename_kind_set(lang, "variable_declarator", RENAME_DECLARATOR);
+	rename_kind_set(lang, "identifier", RENAME_IDENTIFIER);
+}
+
+int rename_kind(TSNode node) {
+	TSSymbol sym = ts_node_symbol(node);
+	return sym < rename_kind_count ? rename_kinds[sym] : RENAME_OTHER;
+}
+
+typedef struct RenameName {
+	uint32_t start; // first occurrence in the source
+	uint32_t len;
+	uint32_t top;   // innermost binding, MERGE_NONE when unbound
+} RenameName;
+
+typedef struct RenameBinding {
+	uint32_t name;
+	uint32_t shadowed;
+	size_t var;
+} RenameBinding;
+
+typedef struct RenameFrame {
+	uint32_t named_seen; // named children entered so far
+	uint32_t scope;      // bindings to unwind to, MERGE_NONE if not a scope
+	int kind;
+} RenameFrame;
+
+typedef struct Renamer {
+	const char *source;
+	RenameName *names;
+	uint32_t *slots; // open addressing index into names
+	RenameBinding *bindings;
+	RenameFrame *frames;
+	StringChanges *changes;
+	size_t var_count;
+} Renamer;
+
+size_t renamer_slot(Renamer *r, const char *name, size_t len) {
+	size_t mask = arrlenu(r->slots) - 1;
+	size_t i = sym_hash(0, name, len) & mask;
+	while(r->slots[i] != MERGE_NONE) {
+		RenameName *n = &r->names[r->slots[i]];
+		if(n->len == len && memcmp(r->source + n->start, name, len) == 0)
 			break;
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+uint32_t renamer_name(Renamer *r, size_t start, size_t end) {
+	const char *name = r->source + start;
+	size_t len = end - start;
+
+	if((arrlenu(r->names) + 1) * 2 > arrlenu(r->slots)) {
+		size_t cap = arrlenu(r->slots) ? arrlenu(r->slots) * 2 : 256;
+		arrsetlen(r->slots, cap);
+		memset(r->slots, 0xFF, cap * sizeof(uint32_t));
+		for(size_t i = 0; i < arrlenu(r->names); ++i) {
+			RenameName *n = &r->names[i];
+			r->slots[renamer_slot(r, r->source + n->start, n->len)] = (uint32_t)i;
 		}
 	}
+
+	size_t slot = renamer_slot(r, name, len);
+	if(r->slots[slot] == MERGE_NONE) {
+		RenameName n = { (uint32_t)start, (uint32_t)len, MERGE_NONE };
+		r->slots[slot] = (uint32_t)arrlenu(r->names);
+		arrput(r->names, n);
+	}
+	return r->slots[slot];
+}
+
+void renamer_change(Renamer *r, TSNode node, size_t var) {
+	StringChanges c;
+	c.start = ts_node_start_byte(node);
+	c.end = ts_node_end_byte(node);
+	snprintf(c.text, sizeof(c.text), "v%zu", var);
+	arrput(r->changes, c);
+}
+
+void renamer_declare(Renamer *r, TSNode identifier) {
+	uint32_t name = renamer_name(r, ts_node_start_byte(identifier), ts_node_end_byte(identifier));
+	RenameBinding b = { name, r->names[name].top, r->var_count++ };
+	r->names[name].top = (uint32_t)arrlenu(r->bindings);
+	arrput(r->bindings, b);
+	renamer_change(r, identifier, b.var);
+}
+
+void renamer_use(Renamer *r, TSNode identifier) {
+	uint32_t name = renamer_name(r, ts_node_start_byte(identifier), ts_node_end_byte(identifier));
+	uint32_t top = r->names[name].top;
+	if(top != MERGE_NONE)
+		renamer_change(r, identifier, r->bindings[top].var);
 }
 
-int pair_already_merged(Pair *pairs, Item *a, Item *b) {
-	if(pairs == NULL || a == NULL || b == NULL)
-		assert(1);
+void renamer_enter(Renamer *r, TSNode node) {
+	RenameFrame *parent = arrlenu(r->frames) > 0 ? &arrlast(r->frames) : NULL;
+	uint32_t index = parent ? parent->named_seen++ : 0;
 
-	if(arrlenu(pairs) == 0)
-		assert(1);
+	RenameFrame frame = { 0, MERGE_NONE, rename_kind(node) };
+	if(frame.kind == RENAME_SCOPE)
+		frame.scope = (uint32_t)arrlenu(r->bindings);
 
-	for(size_t i = 0; i < arrlenu(pairs); ++i) {
-		if((items_equal(pairs[i].a, a) && items_equal(pairs[i].b, b))
-		   || (items_equal(pairs[i].a, b) && items_equal(pairs[i].b, a)))
-			return (int)i;
+	if(frame.kind == RENAME_DECLARATION) {
+		TSNode declarator = ts_node_named_child(node, 0);
+		if(rename_kind(declarator) == RENAME_DECLARATOR) {
+			TSNode identifier = ts_node_named_child(declarator, 0);
+			if(rename_kind(identifier) == RENAME_IDENTIFIER)
+				renamer_declare(r, identifier);
+		}
+	} else if(frame.kind == RENAME_IDENTIFIER) {
+		//
+		// NOTE: A declarator's own name was renamed with its declaration.
+		//
+		if(parent == NULL || parent->kind != RENAME_DECLARATOR || index != 0)
+			renamer_use(r, node);
 	}
-	return -1;
+	arrput(r->frames, frame);
 }
 
-Scope* create_scope(Scope *parent) {
-    Scope *scope = (Scope*)malloc(sizeof(Scope));
-    scope->variables = NULL;
-    scope->parent = parent;
-    return scope;
+void renamer_leave(Renamer *r) {
+	RenameFrame frame = arrpop(r->frames);
+	if(frame.scope == MERGE_NONE) return;
+
+	for(size_t i = arrlenu(r->bindings); i > frame.scope; --i) {
+		RenameBinding *b = &r->bindings[i - 1];
+		r->names[b->name].top = b->shadowed;
+	}
+	arrsetlen(r->bindings, frame.scope);
 }
 
-void add_variable(Scope *scope, const char *original_name, const char *new_name) {
-    Variable *var = (Variable*)malloc(sizeof(Variable));
-    var->original_name = strdup(original_name);
-    var->new_name = strdup(new_name);
-    var->next = scope->variables;
-    scope->variables = var;
+//
+// Walk the named nodes under `root` with a cursor, so deeply nested code
+// cannot overflow the stack. Returns the changes in source order.
+//
+StringChanges *rename_variables(TSNode root, const char *source_code, size_t *var_count) {
+	pthread_once(&rename_kinds_once, rename_kinds_init);
+
+	Renamer r = {0};
+	r.source = source_code;
+	r.var_count = *var_count;
+
+	TSTreeCursor cursor = ts_tree_cursor_new(root);
+	renamer_enter(&r, root);
+	while(1) {
+		if(ts_tree_cursor_goto_first_child(&cursor)) {
+			//
+			// NOTE: Anonymous nodes are punctuation and keywords, skip them.
+			//
+			while(!ts_node_is_named(ts_tree_cursor_current_node(&cursor))) {
+				if(ts_tree_cursor_goto_next_sibling(&cursor)) continue;
+				ts_tree_cursor_goto_parent(&cursor);
+				goto leave;
+			}
+			renamer_enter(&r, ts_tree_cursor_current_node(&cursor));
+			continue;
+		}
+
+	leave:
+		while(1) {
+			renamer_leave(&r);
+			if(arrlenu(r.frames) == 0) goto done;
+
+			int entered = 0;
+			while(ts_tree_cursor_goto_next_sibling(&cursor)) {
+				if(ts_node_is_named(ts_tree_cursor_current_node(&cursor))) {
+					entered = 1;
+					break;
+				}
+			}
+			if(entered) {
+				renamer_enter(&r, ts_tree_cursor_current_node(&cursor));
+				break;
+			}
+			ts_tree_cursor_goto_parent(&cursor);
+		}
+	}
+
+done:
+	ts_tree_cursor_delete(&cursor);
+	arrfree(r.names);
+	arrfree(r.slots);
+	arrfree(r.bindings);
+	arrfree(r.frames);
+
+	*var_count = r.var_count;
+	return r.changes;
 }
 
-const char* find_variable(Scope *scope, const char *name) {
-    while (scope != NULL) {
-        Variable *current = scope->variables;
-        while (current != NULL) {
-            if (strcmp(current->original_name, name) == 0) {
-                return current->new_name;
-            }
-            current = current->next;
-        }
-        scope = scope->parent;
-    }
-    return NULL;
+int compare_size_t_asc(const void *a, const void *b) {
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+	return (x > y) - (x < y);
 }
 
-int is_scope_boundary(const char *type) {
-    return strcmp(type, "statement_block") == 0 ||
-		strcmp(type, "function_declaration") == 0 ||
-		strcmp(type, "method_definition") == 0 ||
-		strcmp(type, "class_body") == 0 ||
-		strcmp(type, "for_statement") == 0 ||
-		strcmp(type, "while_statement") == 0 ||
-		strcmp(type, "if_statement") == 0;
+//
+// Incremental BPE merge engine.
+//
+// Tokens live in a doubly linked list backed by an array, so the index of a
+// node is its original position in the file. Every adjacent pair is counted
+// in a hash table together with the nodes it starts at, and each count change
+// is pushed to a max-heap. Stale heap entries are dropped lazily when popped,
+// so merging a pair only pays for the neighbours of its occurrences.
+//
+// NOTE: This intentionally learns a different vocabulary than the original
+// bpe_parse. That one scanned pairs in file order and merged any pair seen
+// more often than the last one it merged in the same pass, with the bar reset
+// to 2 every pass. The merges it found depended on where in the file a pair
+// first showed up, not on how frequent the pair was. It also counted
+// overlapping matches in runs such as `a a a` and then built merged items
+// whose right child had already been merged. Here the most frequent pair is
+// always merged first, occurrences never overlap, and the order is
+// deterministic. Ids differ from those of the original, so a bpe.bin
+// learned by it, and every model trained on one, has to be regenerated.
+//
+#define BPE_NIL ((size_t)-1)
+#define BPE_MIN_FREQ 3
+
+typedef struct BpeNode {
+	Symbol sym;
+	size_t prev;
+	size_t next;
+} BpeNode;
+
+typedef struct BpePairKey {
+	Symbol a;
+	Symbol b;
+} BpePairKey;
+
+typedef struct BpePairStat {
+	BpePairKey key;
+	size_t count;
+	size_t *positions;
+} BpePairStat;
+
+typedef struct BpeHeapEntry {
+	size_t count;
+	BpePairKey key;
+} BpeHeapEntry;
+
+typedef struct BpeMerger {
+	BpeNode *nodes;
+	BpePairStat *pairs;
+	uint32_t *slots; // open addressing index into pairs
+	BpeHeapEntry *heap;
+	size_t min_freq;
+} BpeMerger;
+
+//
+// Higher count wins, ties go to the smaller pair so the order is deterministic.
+//
+int bpe_heap_before(BpeHeapEntry *x, BpeHeapEntry *y) {
+	if(x->count != y->count) return x->count > y->count;
+	if(x->key.a != y->key.a) return x->key.a < y->key.a;
+	return x->key.b < y->key.b;
 }
 
-void rename_variables(TSNode node, const char *source_code, StringChanges ***changes, Scope *current_scope) {
-    const char *node_type = ts_node_type(node);
+void bpe_heap_push(BpeHeapEntry **heap, BpeHeapEntry e) {
+	arrput(*heap, e);
+	BpeHeapEntry *h = *heap;
+	size_t i = arrlenu(h) - 1;
+	while(i > 0) {
+		size_t parent = (i - 1) / 2;
+		if(!bpe_heap_before(&h[i], &h[parent])) break;
+		BpeHeapEntry tmp = h[i];
+		h[i] = h[parent];
+		h[parent] = tmp;
+		i = parent;
+	}
+}
 
-    Scope *new_scope = NULL;
-    if (is_scope_boundary(node_type)) {
-        new_scope = create_scope(current_scope);
-        current_scope = new_scope;
-    }
+BpeHeapEntry bpe_heap_pop(BpeHeapEntry **heap) {
+	BpeHeapEntry *h = *heap;
+	BpeHeapEntry top = h[0];
+	h[0] = arrpop(*heap);
+	h = *heap;
 
-    if (strcmp(node_type, "lexical_declaration") == 0 ||
-        strcmp(node_type, "variable_declaration") == 0) {
-
-        TSNode declarator = ts_node_named_child(node, 0);
-        if (strcmp(ts_node_type(declarator), "variable_declarator") == 0) {
-            TSNode identifier = ts_node_named_child(declarator, 0);
-            if (strcmp(ts_node_type(identifier), "identifier") == 0) {
-                size_t start = ts_node_start_byte(identifier);
-                size_t end = ts_node_end_byte(identifier);
-                char *original_name = strndup(source_code + start, end - start);
-
-                char new_name[32];
-                snprintf(new_name, sizeof(new_name), "v%zu", var_count++);
-
-                add_variable(current_scope, original_name, new_name);
-
-                StringChanges *c = malloc(sizeof(StringChanges));
-                c->start = start;
-                c->end = end;
-                strncpy(c->text, new_name, sizeof(c->text));
-                arrput(*changes, c);
-
-                free(original_name);
-            }
-        }
-    } else if (strcmp(node_type, "identifier") == 0) {
-        TSNode parent = ts_node_parent(node);
-        if (strcmp(ts_node_type(parent), "variable_declarator") == 0 &&
-            ts_node_named_child(parent, 0).id == node.id) {
-			// ...
-        } else {
-            size_t start = ts_node_start_byte(node);
-            size_t end = ts_node_end_byte(node);
-            char *name = strndup(source_code + start, end - start);
-
-            const char *new_name = find_variable(current_scope, name);
-            if (new_name != NULL) {
-                StringChanges *c = malloc(sizeof(StringChanges));
-                c->start = start;
-                c->end = end;
-                strncpy(c->text, new_name, sizeof(c->text));
-                arrput(*changes, c);
-            }
-            free(name);
-        }
-    }
+	size_t n = arrlenu(h), i = 0;
+	while(1) {
+		size_t l = 2 * i + 1, r = l + 1, best = i;
+		if(l < n && bpe_heap_before(&h[l], &h[best])) best = l;
+		if(r < n && bpe_heap_before(&h[r], &h[best])) best = r;
+		if(best == i) break;
+		BpeHeapEntry tmp = h[i];
+		h[i] = h[best];
+		h[best] = tmp;
+		i = best;
+	}
+	return top;
+}
 
-    uint32_t child_count = ts_node_named_child_count(node);
-    for (uint32_t i = 0; i < child_count; i++) {
-        TSNode child = ts_node_named_child(node, i);
-        rename_variables(child, source_code, changes, current_scope);
-    }
+//
+// NOTE: stb_ds hash maps share a global seed, which is not safe once files
+// are learned on several threads, hence the hand rolled table.
+//
+size_t bpe_merger_slot(BpeMerger *m, BpePairKey key) {
+	size_t mask = arrlenu(m->slots) - 1;
+	size_t i = merge_hash(key.a, key.b) & mask;
+	while(m->slots[i] != MERGE_NONE) {
+		BpePairStat *stat = &m->pairs[m->slots[i]];
+		if(stat->key.a == key.a && stat->key.b == key.b)
+			break;
+		i = (i + 1) & mask;
+	}
+	return i;
+}
 
-    if (new_scope != NULL) {
-        Variable *var = new_scope->variables;
-        while (var != NULL) {
-            Variable *next = var->next;
-            free(var->original_name);
-            free(var->new_name);
-            free(var);
-            var = next;
-        }
-        free(new_scope);
-    }
+BpePairStat *bpe_merger_find(BpeMerger *m, BpePairKey key) {
+	if(arrlenu(m->slots) == 0) return NULL;
+	uint32_t ix = m->slots[bpe_merger_slot(m, key)];
+	return ix == MERGE_NONE ? NULL : &m->pairs[ix];
 }
 
-void rename_children_variables(TSNode root, const char *source_code, StringChanges ***changes) {
-    Scope *global_scope = create_scope(NULL);
-    rename_variables(root, source_code, changes, global_scope);
+BpePairStat *bpe_merger_insert(BpeMerger *m, BpePairKey key) {
+	if((arrlenu(m->pairs) + 1) * 2 > arrlenu(m->slots)) {
+		size_t cap = arrlenu(m->slots) ? arrlenu(m->slots) * 2 : 1024;
+		arrsetlen(m->slots, cap);
+		memset(m->slots, 0xFF, cap * sizeof(uint32_t));
+		for(size_t i = 0; i < arrlenu(m->pairs); ++i)
+			m->slots[bpe_merger_slot(m, m->pairs[i].key)] = (uint32_t)i;
+	}
 
-    Variable *var = global_scope->variables;
-    while (var != NULL) {
-        Variable *next = var->next;
-        free(var->original_name);
-        free(var->new_name);
-        free(var);
-        var = next;
-    }
-    free(global_scope);
+	size_t slot = bpe_merger_slot(m, key);
+	if(m->slots[slot] == MERGE_NONE) {
+		BpePairStat s = { key, 0, NULL };
+		m->slots[slot] = (uint32_t)arrlenu(m->pairs);
+		arrput(m->pairs, s);
+	}
+	return &m->pairs[m->slots[slot]];
 }
 
-int compare_size_t_desc(const void *a, const void *b) {
-    return (*(size_t *)b - *(size_t *)a);
+void bpe_merger_count(BpeMerger *m, Symbol a, Symbol b, size_t pos, int delta) {
+	BpePairKey key = { a, b };
+	BpePairStat *stat = bpe_merger_insert(m, key);
+
+	if(delta > 0) {
+		stat->count++;
+		arrput(stat->positions, pos);
+	} else {
+		assert(stat->count > 0);
+		stat->count--;
+	}
+
+	if(stat->count >= m->min_freq) {
+		BpeHeapEntry e = { stat->count, key };
+		bpe_heap_push(&m->heap, e);
+	}
 }
 
-int bpe_parse(char *path) {
-	var_count = 0;
-	printf("[INFO] Processing %s file.\n", path);
+void bpe_merger_init(BpeMerger *m, size_t min_freq) {
+	m->nodes = NULL;
+	m->pairs = NULL;
+	m->slots = NULL;
+	m->heap = NULL;
+	m->min_freq = min_freq;
+}
+
+//
+// Append a token sequence, pairs never span two sequences.
+//
+void bpe_merger_add(BpeMerger *m, Symbol *syms, size_t len) {
+	size_t base = arrlenu(m->nodes);
+	arrsetlen(m->nodes, base + len);
+	for(size_t i = 0; i < len; ++i) {
+		m->nodes[base + i].sym = syms[i];
+		m->nodes[base + i].prev = i > 0 ? base + i - 1 : BPE_NIL;
+		m->nodes[base + i].next = i + 1 < len ? base + i + 1 : BPE_NIL;
+	}
+
+	for(size_t i = 0; i + 1 < len; ++i)
+		bpe_merger_count(m, syms[i], syms[i+1], base + i, 1);
+}
+
+//
+// Find the most frequent pair which still occurs at least min_freq times.
+//
+int bpe_merger_best(BpeMerger *m, BpePairKey *key, size_t *count) {
+	while(arrlenu(m->heap) > 0) {
+		BpeHeapEntry e = bpe_heap_pop(&m->heap);
+		BpePairStat *stat = bpe_merger_find(m, e.key);
+		if(stat == NULL || stat->count != e.count) continue;
+
+		*key = e.key;
+		*count = e.count;
+		return 1;
+	}
+	return 0;
+}
+
+//
+// Replace every occurrence of `key`, left to right, with `sym`.
+//
+size_t bpe_merger_apply(BpeMerger *m, BpePairKey key, Symbol sym) {
+	BpePairStat *stat = bpe_merger_find(m, key);
+	if(stat == NULL) return 0;
 
 	//
-	// Loading javascript file.
+	// NOTE: Detach the positions, new pairs may grow the table under us.
 	//
+	size_t *positions = stat->positions;
+	stat->positions = NULL;
+	qsort(positions, arrlenu(positions), sizeof(size_t), compare_size_t_asc);
+
+	BpeNode *nodes = m->nodes;
+	size_t merged = 0;
+	for(size_t k = 0; k < arrlenu(positions); ++k) {
+		size_t i = positions[k];
+		size_t j = nodes[i].next;
+		if(nodes[i].sym != key.a || j == BPE_NIL || nodes[j].sym != key.b)
+			continue;
+
+		size_t p = nodes[i].prev, n = nodes[j].next;
+
+		if(p != BPE_NIL) bpe_merger_count(m, nodes[p].sym, key.a, p, -1);
+		if(n != BPE_NIL) bpe_merger_count(m, key.b, nodes[n].sym, j, -1);
+		bpe_merger_count(m, key.a, key.b, i, -1);
+
+		nodes[i].sym = sym;
+		nodes[i].next = n;
+		if(n != BPE_NIL) nodes[n].prev = i;
+		nodes[j].sym = SYM_NONE;
+		nodes[j].prev = nodes[j].next = BPE_NIL;
+
+		if(p != BPE_NIL) bpe_merger_count(m, nodes[p].sym, sym, p, 1);
+		if(n != BPE_NIL) bpe_merger_count(m, sym, nodes[n].sym, i, 1);
+		++merged;
+	}
+	arrfree(positions);
+	return merged;
+}
+
+void bpe_merger_free(BpeMerger *m) {
+	for(size_t i = 0; i < arrlenu(m->pairs); ++i)
+		arrfree(m->pairs[i].positions);
+	arrfree(m->pairs);
+	arrfree(m->slots);
+	arrfree(m->nodes);
+	arrfree(m->heap);
+}
+
+//
+// Rank-ordered encoder.
+//
+// Applies learned merges the way production BPE tokenizers do: every
+// adjacent pair with a rule sits in a min-heap keyed by (rank, position), the
+// lowest one is merged and only its two new neighbour pairs are looked up.
+//
+typedef struct BpeRankEntry {
+	uint32_t rank;
+	size_t pos;
+} BpeRankEntry;
+
+int bpe_rank_before(BpeRankEntry *x, BpeRankEntry *y) {
+	if(x->rank != y->rank) return x->rank < y->rank;
+	return x->pos < y->pos;
+}
+
+void bpe_rank_push(BpeRankEntry **heap, MergeTable *m, Symbol a, Symbol b, size_t pos) {
+	uint32_t rank = merge_find(m, a, b);
+	if(rank == MERGE_NONE) return;
+
+	BpeRankEntry e = { rank, pos };
+	arrput(*heap, e);
+	BpeRankEntry *h = *heap;
+	size_t i = arrlenu(h) - 1;
+	while(i > 0) {
+		size_t parent = (i - 1) / 2;
+		if(!bpe_rank_before(&h[i], &h[parent])) break;
+		BpeRankEntry tmp = h[i];
+		h[i] = h[parent];
+		h[parent] = tmp;
+		i = parent;
+	}
+}
+
+BpeRankEntry bpe_rank_pop(BpeRankEntry **heap) {
+	BpeRankEntry *h = *heap;
+	BpeRankEntry top = h[0];
+	h[0] = arrpop(*heap);
+	h = *heap;
+
+	size_t n = arrlenu(h), i = 0;
+	while(1) {
+		size_t l = 2 * i + 1, r = l + 1, best = i;
+		if(l < n && bpe_rank_before(&h[l], &h[best])) best = l;
+		if(r < n && bpe_rank_before(&h[r], &h[best])) best = r;
+		if(best == i) break;
+		BpeRankEntry tmp = h[i];
+		h[i] = h[best];
+		h[best] = tmp;
+		i = best;
+	}
+	return top;
+}
+
+//
+// Merge `syms` in place, returns the encoded length.
+//
+size_t bpe_merge_symbols(MergeTable *m, Symbol *syms, size_t len) {
+	if(len < 2) return len;
+
+	size_t *next = NULL, *prev = NULL;
+	BpeRankEntry *heap = NULL;
+	arrsetlen(next, len);
+	arrsetlen(prev, len);
+	for(size_t i = 0; i < len; ++i) {
+		prev[i] = i > 0 ? i - 1 : BPE_NIL;
+		next[i] = i + 1 < len ? i + 1 : BPE_NIL;
+	}
+
+	for(size_t i = 0; i + 1 < len; ++i)
+		bpe_rank_push(&heap, m, syms[i], syms[i+1], i);
+
+	while(arrlenu(heap) > 0) {
+		BpeRankEntry e = bpe_rank_pop(&heap);
+		size_t i = e.pos, j = next[i];
+		Pair *p = &m->pairs[e.rank];
+
+		//
+		// NOTE: Entries of pairs already consumed by a merge are stale.
+		//
+		if(syms[i] != p->a || j == BPE_NIL || syms[j] != p->b)
+			continue;
+
+		syms[i] = p->item_id;
+		syms[j] = SYM_NONE;
+		next[i] = next[j];
+		if(next[j] != BPE_NIL) prev[next[j]] = i;
+
+		if(prev[i] != BPE_NIL)
+			bpe_rank_push(&heap, m, syms[prev[i]], syms[i], prev[i]);
+		if(next[i] != BPE_NIL)
+			bpe_rank_push(&heap, m, syms[i], syms[next[i]], i);
+	}
+
+	size_t out = 0;
+	for(size_t i = 0; i != BPE_NIL; i = next[i])
+		syms[out++] = syms[i];
+
+	arrfree(next);
+	arrfree(prev);
+	arrfree(heap);
+	return out;
+}
 
+//
+// Per-file learning state. Symbols are local to the file, so files can be
+// learned on any thread and folded into the global tables afterwards.
+//
+typedef struct BpeFile {
+	const char *path;
+	SymbolTable symbols;
+	Symbol *tokens;
+	Pair *pairs; // merges in learned order, in file-local symbols
+	TSParser *parser; // owned by the thread learning the file
+	int status;
+} BpeFile;
+
+//
+// Read a whole file into a NUL terminated buffer.
+//
+char *bpe_read_file(const char *path, size_t *len) {
 	FILE *file = fopen(path, "r");
 	if(file == NULL) {
 		fprintf(stderr, "[ERROR] Failed to open the file.");
-		return 1;
+		return NULL;
 	}
 
 	fseek(file, 0, SEEK_END);
@@ -291,7 +1014,7 @@ int bpe_parse(char *path) {
 	if (input_stream == NULL) {
 		fprintf(stderr, "[ERROR] Failed to allocate memory for input stream.");
 		fclose(file);
-		return 1;
+		return NULL;
 	}
 
 	size_t read_size = fread(input_stream, 1, file_size, file);
@@ -299,386 +1022,1006 @@ int bpe_parse(char *path) {
 		fprintf(stderr, "[ERROR] Failed to read the file.");
 		free(input_stream);
 		fclose(file);
-		return 1;
+		return NULL;
 	}
 	fclose(file);
 	input_stream[file_size] = '\0';
 
-	//
-	// Rename variables using tree-sitter
-	//
-    TSParser *parser = ts_parser_new();
-	ts_parser_set_language(parser, tree_sitter_javascript());
-
-	TSTree *tree = ts_parser_parse_string(parser, NULL, input_stream, strlen(input_stream));
-    TSNode root = ts_tree_root_node(tree);
+	*len = file_size;
+	return input_stream;
+}
 
-	printf("[INFO] Code parsed using tree-sitter.\n");
+TSParser *bpe_parser_new() {
+	TSParser *parser = ts_parser_new();
+	ts_parser_set_language(parser, tree_sitter_javascript());
+	return parser;
+}
 
-	StringChanges **changes = NULL;
-	rename_children_variables(root, input_stream, &changes);
+//
+// Rewrite `source` with every variable renamed to 'vN'. Returns a NUL
+// terminated buffer, or NULL when out of memory.
+//
+char *bpe_rename_source(TSNode root, const char *source, size_t len, size_t *out_len, size_t *renamed) {
+	size_t var_count = 0;
+	StringChanges *changes = rename_variables(root, source, &var_count);
 
-    ts_tree_delete(tree);
-    ts_parser_delete(parser);
+	size_t output_size = len;
+	for(size_t i = 0; i < arrlenu(changes); ++i)
+		output_size += strlen(changes[i].text) - (changes[i].end - changes[i].start);
 
-	//
-	// Update the variable name in code.
-	//
-	char *code_output = (char *)malloc(file_size + 1);
+	char *code_output = (char *)malloc(output_size + 1);
 	if (code_output == NULL) {
 		fprintf(stderr, "[ERROR] Failed to allocate memory for code output.");
-
-		for(size_t i = 0; i < arrlenu(changes); ++i)
-			free(changes[i]);
 		arrfree(changes);
-		free(input_stream);
-
-		return 1;
+		return NULL;
 	}
 
 	size_t out_index = 0, src_index = 0;
 	for(size_t i = 0; i < arrlenu(changes); ++i) {
 		/*
 		printf("%.*s => %s\n",
-			   (int)(changes[i]->end - changes[i]->start),
-			   input_stream + changes[i]->start,
-			   changes[i]->text);
+			   (int)(changes[i].end - changes[i].start),
+			   source + changes[i].start,
+			   changes[i].text);
 		*/
 
-		while (src_index < changes[i]->start)
-			code_output[out_index++] = input_stream[src_index++];
+		while (src_index < changes[i].start)
+			code_output[out_index++] = source[src_index++];
 
-		const char *r = changes[i]->text;
+		const char *r = changes[i].text;
 		while (*r)
 			code_output[out_index++] = *r++;
 
-		src_index = changes[i]->end;
-		free(changes[i]);
+		src_index = changes[i].end;
 	}
 
-	while (input_stream[src_index])
-        code_output[out_index++] = input_stream[src_index++];
+	while (src_index < len)
+        code_output[out_index++] = source[src_index++];
     code_output[out_index] = '\0';
 
-	// printf("%s", code_output);
-	printf("[INFO] Renamed %zu variables in the code.\n", arrlenu(changes));
-
+	*out_len = out_index;
+	*renamed = arrlenu(changes);
 	arrfree(changes);
-	free(input_stream);
+	return code_output;
+}
+
+int bpe_tokenize_file(BpeFile *f) {
+	const char *path = f->path;
+	printf("[INFO] Processing %s file.\n", path);
 
 	//
-	// BPE logic
+	// Loading javascript file.
 	//
-	char *code_output_end = code_output + out_index;
-	Item **items = NULL;
+	size_t file_size;
+	char *input_stream = bpe_read_file(path, &file_size);
+	if(input_stream == NULL) return 1;
 
-	stb_lexer lexer;
-	char string_store[1028];
-	stb_c_lexer_init(&lexer, code_output, code_output_end, string_store, sizeof(string_store));
+	//
+	// Rename variables using tree-sitter
+	//
+	TSTree *tree = ts_parser_parse_string(f->parser, NULL, input_stream, file_size);
+    TSNode root = ts_tree_root_node(tree);
 
-	int token = stb_c_lexer_get_token(&lexer);
-	while(token != 0) {
-		if(lexer.token == CLEX_parse_error) {
-			fprintf(stderr, "[ERROR] Parse error.\n");
-		} else {
-			Item *itm = malloc(sizeof(Item));
-			itm->left = NULL;
-			itm->right = NULL;
-			itm->value.string = NULL;
-			copy_into_item(itm, &lexer);
-			arrput(items, itm);
-			arrput(global_items, itm);
-		}
-		token = stb_c_lexer_get_token(&lexer);
-	}
+	printf("[INFO] Code parsed using tree-sitter.\n");
+
+	size_t out_len, renamed;
+	char *code_output = bpe_rename_source(root, input_stream, file_size, &out_len, &renamed);
+    ts_tree_delete(tree);
+	free(input_stream);
+	if(code_output == NULL) return 1;
+
+	// printf("%s", code_output);
+	printf("[INFO] Renamed %zu variables in the code.\n", renamed);
 
-	if(arrlenu(items) < 2) {
+	//
+	// Lexing, merges are learned by the caller.
+	//
+	f->tokens = bpe_lex(&f->symbols, code_output, out_len, 1);
+	free(code_output);
+
+	if(arrlenu(f->tokens) < 2) {
 		fprintf(stderr, "[ERROR] Not enough tokens.\n");
-		for(size_t i = 0; i < arrlenu(items); ++i)
-			free_item(items[i]);
-		arrfree(items);
-		free(code_output);
 		return 1;
 	}
+	return 0;
+}
 
-	Pair *merged_pairs = NULL;
-	size_t *match_indexes = NULL;
+int bpe_learn_file(BpeFile *f) {
+	int status = bpe_tokenize_file(f);
+	if(status != 0) return status;
+
+	BpeMerger merger;
+	bpe_merger_init(&merger, BPE_MIN_FREQ);
+	bpe_merger_add(&merger, f->tokens, arrlenu(f->tokens));
+	arrfree(f->tokens);
+
+	BpePairKey best;
+	size_t freq;
+	while(bpe_merger_best(&merger, &best, &freq)) {
+		Pair p = { best.a, best.b, sym_merge(&f->symbols, best.a, best.b) };
+		arrput(f->pairs, p);
+		bpe_merger_apply(&merger, best, p.item_id);
+	}
+	bpe_merger_free(&merger);
 
-	while(1) {
-		size_t m_freq = 2, freq = 0, p1 = 0, p2 = 1, match_count = 0;
-		while(p2 < arrlenu(items)) {
-			//
-			// NOTE: Each pair will be freed by bpe_free()
-			//
-			arrsetlen(match_indexes, 0);
+	printf("[INFO] File processing done.\n");
 
-			//
-			// Sliding window
-			//
-			for (size_t k = 0; k + 1 < arrlenu(items); ++k) {
-				if (items_equal(items[k], items[p1]) && items_equal(items[k+1], items[p2])) {
-					arrput(match_indexes, k);
-					++freq;
-				}
-			}
+	return 0;
+}
 
-			if(freq > m_freq && pair_already_merged(merged_pairs, items[p1], items[p2]) < 0) {
-				int global_ix = pair_already_merged(merged_pairs, items[p1], items[p2]);
-				size_t item_id;
+//
+// Fold a learned file into the global tables. Files must be committed in the
+// same order every time for the ids to be reproducible.
+//
+void bpe_commit_file(BpeFile *f) {
+	Symbol *map = NULL;
+	arrsetlen(map, f->symbols.count);
+
+	for(size_t i = 0; i < f->symbols.count; ++i) {
+		SymbolInfo *s = &f->symbols.syms[i];
+		if(s->left == SYM_NONE)
+			map[i] = sym_intern(&global_symbols, s->token, f->symbols.strings + s->offset, s->len);
+	}
 
-				if(global_ix > -1) {
-					item_id = global_pairs[global_ix]->item_id;
-				} else {
-					item_id = item_counter++;
-				}
+	for(size_t i = 0; i < arrlenu(f->pairs); ++i) {
+		Symbol a = map[f->pairs[i].a], b = map[f->pairs[i].b];
 
-				Pair *p = malloc(sizeof(Pair));
-				p->a = items[p1];
-				p->b = items[p2];
-				p->item_id = item_id;
+		//
+		// Pairs learned from an earlier file keep their id.
+		//
+		uint32_t rank = merge_find(&global_merges, a, b);
+		if(rank == MERGE_NONE)
+			rank = merge_add(&global_merges, a, b, sym_merge(&global_symbols, a, b));
+		map[f->pairs[i].item_id] = global_merges.pairs[rank].item_id;
+	}
+	arrfree(map);
+}
 
-				arrput(merged_pairs, *p);
-				arrput(global_pairs, p);
+void bpe_file_free(BpeFile *f) {
+	sym_free(&f->symbols);
+	arrfree(f->tokens);
+	arrfree(f->pairs);
+}
 
-				//
-				// NOTE: Process match_indexes in reverse order to avoid index invalidation
-				//
-				qsort(match_indexes, arrlenu(match_indexes), sizeof(size_t), compare_size_t_desc);
+//
+// Kept across bpe_parse() calls, tree-sitter parsers are costly to set up.
+//
+TSParser *bpe_parser = NULL;
 
-				for(size_t i = 0; i < arrlenu(match_indexes); ++i) {
-					size_t k = match_indexes[i];
-					// if(i > 0) --k;
+int bpe_parse(char *path) {
+	if(bpe_parser == NULL) bpe_parser = bpe_parser_new();
+
+	BpeFile f = { path };
+	f.parser = bpe_parser;
+	f.status = bpe_learn_file(&f);
+	if(f.status == 0) {
+		bpe_commit_file(&f);
+		decode_build(&global_decode, &global_symbols);
+	}
+	bpe_file_free(&f);
+	return f.status;
+}
 
-					assert(k + 1 < arrlenu(items));
+typedef struct BpeWorkQueue {
+	BpeFile *files;
+	size_t count;
+	int (*job)(BpeFile *f);
+	atomic_size_t next;
+} BpeWorkQueue;
+
+void *bpe_worker(void *arg) {
+	BpeWorkQueue *queue = arg;
+	TSParser *parser = bpe_parser_new();
+	size_t i;
+	while((i = atomic_fetch_add(&queue->next, 1)) < queue->count) {
+		queue->files[i].parser = parser;
+		queue->files[i].status = queue->job(&queue->files[i]);
+		queue->files[i].parser = NULL;
+	}
+	ts_parser_delete(parser);
+	return NULL;
+}
 
-					Item *itm = malloc(sizeof(Item));
-					itm->id = item_id;
-					itm->left = items[k];
-					itm->right = items[k+1];
-					itm->value.string = NULL;
-					arrput(global_items, itm);
+//
+// Run `job` over every file on up to `threads` workers, the calling thread
+// included. Returns the number of threads used.
+//
+size_t bpe_run_files(BpeFile *files, size_t count, size_t threads, int (*job)(BpeFile *f)) {
+	if(threads < 1) threads = 1;
+	if(threads > count) threads = count;
 
-					items[k] = itm;
+	BpeWorkQueue queue = { files, count, job };
+	atomic_init(&queue.next, 0);
 
-					arrdel(items, k + 1);
-				}
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	size_t started = 1;
+	for(; workers != NULL && started < threads; ++started) {
+		if(pthread_create(&workers[started], NULL, bpe_worker, &queue) != 0)
+			break;
+	}
+	bpe_worker(&queue);
+	for(size_t t = 1; t < started; ++t)
+		pthread_join(workers[t], NULL);
+	free(workers);
 
-				match_count++;
-				m_freq = freq;
-			}
-			++p1;
-			++p2;
-			freq = 0;
-		}
-		if(match_count < 1) break;
+	return started;
+}
+
+BpeFile *bpe_files_new(const char **paths, size_t count) {
+	BpeFile *files = calloc(count, sizeof(BpeFile));
+	if(files == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for %zu files.\n", count);
+		return NULL;
 	}
-	arrfree(match_indexes);
-	arrfree(merged_pairs);
+	for(size_t i = 0; i < count; ++i)
+		files[i].path = paths[i];
+	return files;
+}
 
-	//
-	// NOTE: Each item will be freed by bpe_free()
-	//
-	arrfree(items);
-	free(code_output);
+//
+// Learn a list of files on `threads` workers. The global tables only change
+// on the calling thread, in list order, so the result does not depend on the
+// thread count. Returns the number of files that failed.
+//
+size_t bpe_parse_files(const char **paths, size_t count, size_t threads) {
+	BpeFile *files = bpe_files_new(paths, count);
+	if(files == NULL) return count;
+
+	size_t used = bpe_run_files(files, count, threads, bpe_learn_file);
+
+	size_t failed = 0;
+	for(size_t i = 0; i < count; ++i) {
+		if(files[i].status == 0)
+			bpe_commit_file(&files[i]);
+		else
+			++failed;
+		bpe_file_free(&files[i]);
+	}
+	free(files);
 
-	printf("[INFO] File processing done.\n");
+	decode_build(&global_decode, &global_symbols);
 
-	return 0;
+	printf("[INFO] Learned %zu files on %zu threads, %zu failed.\n", count, used, failed);
+	return failed;
 }
 
-void bpe_save(const char *path) {
-    FILE *file = fopen(path, "wb");
-    if (file == NULL) {
-        fprintf(stderr, "[ERROR] Failed to open file for saving: %s\n", path);
-        return;
-    }
+//
+// Corpus-wide training. Files are tokenized on `threads` workers, then pair
+// counts are taken over the whole corpus and the most frequent pair is
+// merged until the vocabulary reaches `vocab_size` symbols (0 for no limit)
+// or no pair occurs `min_freq` times. Replaces the current tables with one
+// deduplicated, rank-ordered merge list and returns the vocabulary size, or
+// 0 with the current tables left alone when no file could be read.
+//
+size_t bpe_train_files(const char **paths, size_t count, size_t threads, size_t vocab_size, size_t min_freq) {
+	BpeFile *files = bpe_files_new(paths, count);
+	if(files == NULL) return 0;
+
+	size_t used = bpe_run_files(files, count, threads, bpe_tokenize_file);
+
+	size_t read = 0;
+	for(size_t i = 0; i < count; ++i)
+		if(files[i].status == 0) ++read;
+	if(read == 0) {
+		fprintf(stderr, "[ERROR] None of the %zu files could be read, keeping the current tables.\n", count);
+		for(size_t i = 0; i < count; ++i)
+			bpe_file_free(&files[i]);
+		free(files);
+		return 0;
+	}
 
-    size_t pair_count = arrlenu(global_pairs);
-    fwrite(&pair_count, sizeof(size_t), 1, file);
+	bpe_reset();
 
-    for (size_t i = 0; i < pair_count; ++i) {
-        Pair *pair = global_pairs[i];
+	if(min_freq < 2) min_freq = 2;
 
-        fwrite(&pair->item_id, sizeof(size_t), 1, file);
+	BpeMerger merger;
+	bpe_merger_init(&merger, min_freq);
 
-        for (int j = 0; j < 2; ++j) {
-            Item *item = (j == 0) ? pair->a : pair->b;
-            fwrite(&item->id, sizeof(size_t), 1, file);
-            fwrite(&item->value.token, sizeof(int), 1, file);
+	size_t failed = 0, tokens = 0;
+	for(size_t i = 0; i < count; ++i) {
+		BpeFile *f = &files[i];
+		if(f->status != 0) {
+			++failed;
+			bpe_file_free(f);
+			continue;
+		}
 
-            switch (item->value.token) {
-			case CLEX_id:
-			case CLEX_dqstring:
-			case CLEX_sqstring: {
-				size_t str_len = strlen(item->value.string) + 1;
-				fwrite(&str_len, sizeof(size_t), 1, file);
-				fwrite(item->value.string, sizeof(char), str_len, file);
-				break;
-			}
-			case CLEX_intlit:
-				fwrite(&item->value.int_number, sizeof(int64_t), 1, file);
-				break;
-			case CLEX_floatlit:
-				fwrite(&item->value.real_number, sizeof(double), 1, file);
-				break;
-			default:
-				break;
-            }
-        }
-    }
+		for(size_t k = 0; k < arrlenu(f->tokens); ++k) {
+			SymbolInfo *s = &f->symbols.syms[f->tokens[k]];
+			f->tokens[k] = sym_intern(&global_symbols, s->token, f->symbols.strings + s->offset, s->len);
+		}
+		bpe_merger_add(&merger, f->tokens, arrlenu(f->tokens));
+		tokens += arrlenu(f->tokens);
+		bpe_file_free(f);
+	}
+	free(files);
+
+	BpePairKey best;
+	size_t freq;
+	while((vocab_size == 0 || global_symbols.count < vocab_size)
+		  && bpe_merger_best(&merger, &best, &freq)) {
+		Symbol id = sym_merge(&global_symbols, best.a, best.b);
+		merge_add(&global_merges, best.a, best.b, id);
+		bpe_merger_apply(&merger, best, id);
+	}
+	bpe_merger_free(&merger);
 
-    fclose(file);
-    printf("[INFO] Saved %zu pairs to %s\n", pair_count, path);
+	printf("[INFO] Trained on %zu tokens from %zu files on %zu threads, %zu failed.\n", tokens, count, used, failed);
+	decode_build(&global_decode, &global_symbols);
+
+	printf("[INFO] Learned %zu merges, vocabulary size %zu.\n", global_merges.count, global_symbols.count);
+	return global_symbols.count;
 }
 
-int bpe_load(const char *path) {
-    FILE *file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "[ERROR] Failed to open file for loading: %s\n", path);
-        return -1;
-    }
+int compare_path(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
 
-    size_t pair_count;
-    fread(&pair_count, sizeof(size_t), 1, file);
-    printf("[INFO] Pair count %zu\n", pair_count);
+void bpe_free_paths(char **paths) {
+	for(size_t i = 0; i < arrlenu(paths); ++i)
+		free(paths[i]);
+	arrfree(paths);
+}
 
-    for (size_t i = 0; i < pair_count; ++i) {
-        Pair *pair = malloc(sizeof(Pair));
+//
+// Every .js file in `dir`, in name order. Free with bpe_free_paths().
+//
+char **bpe_list_dir(const char *dir) {
+	DIR *d = opendir(dir);
+	if(d == NULL) {
+		fprintf(stderr, "[ERROR] Failed to open directory %s\n", dir);
+		return NULL;
+	}
 
-        fread(&pair->item_id, sizeof(size_t), 1, file);
+	char **paths = NULL;
+	struct dirent *entry;
+	while((entry = readdir(d)) != NULL) {
+		if(strstr(entry->d_name, ".js") == NULL) continue;
+
+		size_t len = strlen(dir) + strlen(entry->d_name) + 2;
+		char *path = malloc(len);
+		if(path == NULL) {
+			fprintf(stderr, "[ERROR] Failed to allocate memory for the paths in %s\n", dir);
+			closedir(d);
+			bpe_free_paths(paths);
+			return NULL;
+		}
+		snprintf(path, len, "%s/%s", dir, entry->d_name);
+		arrput(paths, path);
+	}
+	closedir(d);
 
-        for (int j = 0; j < 2; ++j) {
-            Item *item = malloc(sizeof(Item));
-            fread(&item->id, sizeof(size_t), 1, file);
-            fread(&item->value.token, sizeof(int), 1, file);
+	if(paths != NULL) qsort(paths, arrlenu(paths), sizeof(char *), compare_path);
+	return paths;
+}
 
-            switch (item->value.token) {
-			case CLEX_id:
-			case CLEX_dqstring:
-			case CLEX_sqstring: {
-				size_t str_len;
-				fread(&str_len, sizeof(size_t), 1, file);
-				item->value.string = malloc(str_len);
-				fread(item->value.string, sizeof(char), str_len, file);
-				break;
-			}
-			case CLEX_intlit:
-				fread(&item->value.int_number, sizeof(int64_t), 1, file);
-				break;
-			case CLEX_floatlit:
-				fread(&item->value.real_number, sizeof(double), 1, file);
-				break;
-			default:
-				item->value.string = NULL;
-				break;
-            }
+size_t bpe_parse_dir(const char *dir, size_t threads) {
+	char **paths = bpe_list_dir(dir);
+	if(paths == NULL) return 1;
 
-            if (j == 0) {
-                pair->a = item;
-            } else {
-                pair->b = item;
-            }
-        }
+	size_t failed = bpe_parse_files((const char **)paths, arrlenu(paths), threads);
+	bpe_free_paths(paths);
+	return failed;
+}
 
-        arrput(global_pairs, pair);
-    }
+size_t bpe_train_dir(const char *dir, size_t threads, size_t vocab_size, size_t min_freq) {
+	char **paths = bpe_list_dir(dir);
+	if(paths == NULL) return 0;
 
-    fclose(file);
-    printf("[INFO] Loaded %zu pairs from %s\n", pair_count, path);
-    return pair_count;
+	size_t vocab = bpe_train_files((const char **)paths, arrlenu(paths), threads, vocab_size, min_freq);
+	bpe_free_paths(paths);
+	return vocab;
 }
 
-void bpe_free() {
-	for(size_t i = 0; i < arrlenu(global_items); ++i)
-		free_item(global_items[i]);
-	arrfree(global_items);
-	global_items = NULL; // Prevent double free
+//
+// Incremental tokenizer.
+//
+// Keeps one parser and, for every path it has seen, the source, its syntax
+// tree and its lexemes. An update diffs the new text against the cached one,
+// edits the old tree so tree-sitter only reparses the changed region, and
+// re-lexes only between the last token before the change and the first old
+// token the lexer lines up with again after it.
+//
+// NOTE: Variables are numbered in file order and a declaration can rename
+// uses anywhere below it, so the rename pass still walks the whole (already
+// parsed) tree. It is cheap next to parsing and lexing.
+//
+#define BPE_LEX_SLACK 4 // characters the lexer may look past a token
+
+typedef struct BpeSpan {
+	uint32_t start;
+	uint32_t end;
+} BpeSpan;
+
+typedef struct BpeDocument {
+	char *path;
+	char *source;
+	size_t source_len;
+	TSTree *tree;
+	char *renamed;  // source after the rename pass, what is lexed
+	size_t renamed_len;
+	Symbol *tokens;
+	BpeSpan *spans; // bytes of every token in `renamed`
+} BpeDocument;
+
+struct BpeTokenizer {
+	TSParser *parser;
+	SymbolTable symbols;
+	BpeDocument *docs;
+	uint32_t *slots; // open addressing index into docs by path
+};
+
+BpeTokenizer *bpe_tokenizer_new() {
+	BpeTokenizer *t = calloc(1, sizeof(BpeTokenizer));
+	if(t == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the tokenizer.\n");
+		return NULL;
+	}
+	t->parser = bpe_parser_new();
+	return t;
+}
+
+size_t bpe_tokenizer_slot(BpeTokenizer *t, const char *path) {
+	size_t mask = arrlenu(t->slots) - 1;
+	size_t i = sym_hash(0, path, strlen(path)) & mask;
+	while(t->slots[i] != MERGE_NONE) {
+		if(strcmp(t->docs[t->slots[i]].path, path) == 0)
+			break;
+		i = (i + 1) & mask;
+	}
+	return i;
+}
 
-	printf("[INFO] Clean up all global items.\n");
+BpeDocument *bpe_tokenizer_find(BpeTokenizer *t, const char *path) {
+	if(arrlenu(t->slots) == 0) return NULL;
+	uint32_t ix = t->slots[bpe_tokenizer_slot(t, path)];
+	return ix == MERGE_NONE ? NULL : &t->docs[ix];
+}
 
-	for(size_t i = 0; i < arrlenu(global_pairs); ++i)
-		free(global_pairs[i]);
-	arrfree(global_pairs);
-	global_pairs = NULL; // Prevent double free
+BpeDocument *bpe_tokenizer_insert(BpeTokenizer *t, const char *path) {
+	if((arrlenu(t->docs) + 1) * 2 > arrlenu(t->slots)) {
+		size_t cap = arrlenu(t->slots) ? arrlenu(t->slots) * 2 : 64;
+		arrsetlen(t->slots, cap);
+		memset(t->slots, 0xFF, cap * sizeof(uint32_t));
+		for(size_t i = 0; i < arrlenu(t->docs); ++i)
+			t->slots[bpe_tokenizer_slot(t, t->docs[i].path)] = (uint32_t)i;
+	}
 
-	printf("[INFO] Clean up all global pairs.\n");
+	size_t slot = bpe_tokenizer_slot(t, path);
+	if(t->slots[slot] == MERGE_NONE) {
+		BpeDocument d = {0};
+		d.path = strdup(path);
+		t->slots[slot] = (uint32_t)arrlenu(t->docs);
+		arrput(t->docs, d);
+	}
+	return &t->docs[t->slots[slot]];
 }
 
-size_t bpe_test(char *input) {
-	size_t input_len = strlen(input);
-	Item **items = NULL;
+TSPoint bpe_point_at(const char *text, size_t offset) {
+	TSPoint point = { 0, 0 };
+	for(size_t i = 0; i < offset; ++i) {
+		if(text[i] == '\n') {
+			point.row++;
+			point.column = 0;
+		} else {
+			point.column++;
+		}
+	}
+	return point;
+}
+
+//
+// Re-lex `text` against the document's previous renamed text, reusing the
+// tokens outside the changed bytes. Returns the number of tokens lexed.
+//
+size_t bpe_document_relex(BpeDocument *d, SymbolTable *symbols, const char *text, size_t len) {
+	const char *old = d->renamed;
+	size_t old_len = d->renamed_len, count = arrlenu(d->tokens);
+
+	size_t prefix = 0, suffix = 0;
+	while(prefix < old_len && prefix < len && old[prefix] == text[prefix])
+		++prefix;
+	while(suffix < old_len - prefix && suffix < len - prefix
+		  && old[old_len - 1 - suffix] == text[len - 1 - suffix])
+		++suffix;
+
+	size_t keep = 0;
+	while(keep < count && d->spans[keep].end + BPE_LEX_SLACK <= prefix)
+		++keep;
+
+	Symbol *tokens = NULL;
+	BpeSpan *spans = NULL;
+	if(keep > 0) {
+		memcpy(arraddnptr(tokens, keep), d->tokens, keep * sizeof(Symbol));
+		memcpy(arraddnptr(spans, keep), d->spans, keep * sizeof(BpeSpan));
+	}
 
 	stb_lexer lexer;
 	char string_store[1028];
-	stb_c_lexer_init(&lexer, input, input + input_len, string_store, sizeof(string_store));
+	size_t from = keep > 0 ? d->spans[keep - 1].end : 0;
+	stb_c_lexer_init(&lexer, text + from, text + len, string_store, sizeof(string_store));
 
-	int token = stb_c_lexer_get_token(&lexer);
-	while(token != 0) {
+	//
+	// NOTE: The lexer carries no state between tokens, once it starts a token
+	// where an old one started inside the unchanged tail, the rest is the same.
+	//
+	size_t tail = keep, lexed = 0;
+	int synced = 0;
+	while(stb_c_lexer_get_token(&lexer)) {
 		if(lexer.token == CLEX_parse_error) {
 			fprintf(stderr, "[ERROR] Parse error.\n");
-			for(size_t i = 0; i < arrlenu(items); ++i)
-				free_item(items[i]);
-			arrfree(items);
-			break;
-		} else {
-			Item *itm = malloc(sizeof(Item));
-			itm->left = NULL;
-			itm->right = NULL;
-			itm->value.string = NULL;
-			copy_into_item(itm, &lexer);
-			arrput(items, itm);
+			continue;
+		}
+
+		size_t start = lexer.where_firstchar - text;
+		size_t end = lexer.where_lastchar - text + 1;
+		if(start >= len - suffix) {
+			size_t old_start = start - len + old_len;
+			while(tail < count && d->spans[tail].start < old_start)
+				++tail;
+			if(tail < count && d->spans[tail].start == old_start) {
+				synced = 1;
+				break;
+			}
+		}
+
+		BpeSpan span = { (uint32_t)start, (uint32_t)end };
+		arrput(tokens, sym_intern(symbols, (int)lexer.token, lexer.where_firstchar, end - start));
+		arrput(spans, span);
+		++lexed;
+	}
+
+	if(synced) {
+		size_t n = count - tail;
+		memcpy(arraddnptr(tokens, n), d->tokens + tail, n * sizeof(Symbol));
+		BpeSpan *moved = arraddnptr(spans, n);
+		for(size_t i = 0; i < n; ++i) {
+			moved[i].start = (uint32_t)(d->spans[tail + i].start + len - old_len);
+			moved[i].end = (uint32_t)(d->spans[tail + i].end + len - old_len);
 		}
-		token = stb_c_lexer_get_token(&lexer);
 	}
 
-	if(arrlenu(items) < 2) {
-		fprintf(stderr, "[ERROR] Not enough tokens.\n");
-		for(size_t i = 0; i < arrlenu(items); ++i)
-			free_item(items[i]);
-		arrfree(items);
+	arrfree(d->tokens);
+	arrfree(d->spans);
+	d->tokens = tokens;
+	d->spans = spans;
+	return lexed;
+}
+
+//
+// Tokenize `source` as the new contents of `path`. Returns 0 on success.
+//
+int bpe_tokenizer_update_source(BpeTokenizer *t, const char *path, const char *source, size_t len) {
+	BpeDocument *d = bpe_tokenizer_find(t, path);
+	if(d == NULL) d = bpe_tokenizer_insert(t, path);
+	else if(d->source != NULL && d->source_len == len && memcmp(d->source, source, len) == 0) return 0;
+
+	char *copy = malloc(len + 1);
+	if(copy == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for %s\n", path);
 		return 1;
 	}
+	memcpy(copy, source, len);
+	copy[len] = '\0';
 
 	//
-	// Find next token based on last token.
+	// NOTE: The edit goes to a copy of the tree so a failed parse or rename
+	// leaves the document as it was and the same source can be retried.
 	//
-	Item *last_item = items[arrlenu(items) - 1];
-	for(size_t i = 0; i < arrlenu(global_pairs); ++i) {
-		if(items_equal(last_item, global_pairs[i]->a)) {
-			print_item(global_pairs[i]->b);
+	TSTree *old_tree = NULL;
+	if(d->tree != NULL) {
+		const char *old = d->source;
+		size_t old_len = d->source_len;
+
+		size_t prefix = 0, suffix = 0;
+		while(prefix < old_len && prefix < len && old[prefix] == source[prefix])
+			++prefix;
+		while(suffix < old_len - prefix && suffix < len - prefix
+			  && old[old_len - 1 - suffix] == source[len - 1 - suffix])
+			++suffix;
+
+		TSInputEdit edit;
+		edit.start_byte = (uint32_t)prefix;
+		edit.old_end_byte = (uint32_t)(old_len - suffix);
+		edit.new_end_byte = (uint32_t)(len - suffix);
+		edit.start_point = bpe_point_at(old, edit.start_byte);
+		edit.old_end_point = bpe_point_at(old, edit.old_end_byte);
+		edit.new_end_point = bpe_point_at(source, edit.new_end_byte);
+		old_tree = ts_tree_copy(d->tree);
+		ts_tree_edit(old_tree, &edit);
+	}
+
+	TSTree *tree = ts_parser_parse_string(t->parser, old_tree, copy, len);
+	if(old_tree != NULL) ts_tree_delete(old_tree);
+	if(tree == NULL) {
+		fprintf(stderr, "[ERROR] Failed to parse %s\n", path);
+		free(copy);
+		return 1;
+	}
+
+	size_t out_len, renamed;
+	char *code_output = bpe_rename_source(ts_tree_root_node(tree), copy, len, &out_len, &renamed);
+	if(code_output == NULL) {
+		ts_tree_delete(tree);
+		free(copy);
+		return 1;
+	}
+
+	bpe_document_relex(d, &t->symbols, code_output, out_len);
+	if(d->tree != NULL) ts_tree_delete(d->tree);
+	free(d->source);
+	free(d->renamed);
+	d->tree = tree;
+	d->source = copy;
+	d->source_len = len;
+	d->renamed = code_output;
+	d->renamed_len = out_len;
+	return 0;
+}
+
+int bpe_tokenizer_update(BpeTokenizer *t, const char *path) {
+	size_t len;
+	char *source = bpe_read_file(path, &len);
+	if(source == NULL) return 1;
+
+	int status = bpe_tokenizer_update_source(t, path, source, len);
+	free(source);
+	return status;
+}
+
+//
+// Lexemes of `path` in the tokenizer's own symbol table, NULL if the path
+// was never updated. Valid until the next update.
+//
+const Symbol *bpe_tokenizer_tokens(BpeTokenizer *t, const char *path, size_t *len) {
+	BpeDocument *d = bpe_tokenizer_find(t, path);
+	*len = d ? arrlenu(d->tokens) : 0;
+	return d ? d->tokens : NULL;
+}
+
+//
+// BPE ids of `path` under the global tables. Free with arrfree().
+//
+Symbol *bpe_tokenizer_encode(BpeTokenizer *t, const char *path, size_t *len) {
+	size_t count;
+	const Symbol *lexemes = bpe_tokenizer_tokens(t, path, &count);
+
+	Symbol *ids = NULL;
+	arrsetlen(ids, count);
+	for(size_t i = 0; i < count; ++i) {
+		SymbolInfo *s = &t->symbols.syms[lexemes[i]];
+		ids[i] = sym_lookup(&global_symbols, s->token, t->symbols.strings + s->offset, s->len);
+	}
+	*len = bpe_merge_symbols(&global_merges, ids, count);
+	arrsetlen(ids, *len);
+	return ids;
+}
+
+void bpe_tokenizer_free(BpeTokenizer *t) {
+	if(t == NULL) return;
+
+	for(size_t i = 0; i < arrlenu(t->docs); ++i) {
+		BpeDocument *d = &t->docs[i];
+		if(d->tree != NULL) ts_tree_delete(d->tree);
+		free(d->path);
+		free(d->source);
+		free(d->renamed);
+		arrfree(d->tokens);
+		arrfree(d->spans);
+	}
+	arrfree(t->docs);
+	arrfree(t->slots);
+	sym_free(&t->symbols);
+	ts_parser_delete(t->parser);
+	free(t);
+}
+
+//
+// bpe.bin layout, version 1. Every section is a fixed-stride array written
+// in host byte order and aligned to 8 bytes, so bpe_load() can map the file
+// and use it in place:
+//
+//   BpeFileHeader
+//   SymbolInfo[sym_count]        symbols in id order
+//   char[strings_len]            string pool, SymbolInfo.offset points here
+//   Symbol[sym_slot_count]       lexeme index
+//   Pair[pair_count]             merge rules in rank order
+//   uint32_t[pair_slot_count]    (a, b) index
+//   uint32_t[pair_slot_count]    left symbol index
+//
+#define BPE_MAGIC "TBPE"
+#define BPE_VERSION 1
+#define BPE_ENDIAN 0x01020304u
+
+typedef struct BpeFileHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t endian;
+	uint32_t header_size;
+	uint64_t sym_count;
+	uint64_t strings_len;
+	uint64_t sym_slot_count;
+	uint64_t pair_count;
+	uint64_t pair_slot_count;
+	uint64_t syms_offset;
+	uint64_t strings_offset;
+	uint64_t sym_slots_offset;
+	uint64_t pairs_offset;
+	uint64_t pair_slots_offset;
+	uint64_t left_slots_offset;
+} BpeFileHeader;
+
+int bpe_write_section(FILE *file, uint64_t *offset, uint64_t *start, const void *data, size_t size) {
+	static const char zeros[8] = {0};
+	*start = (*offset + 7) & ~(uint64_t)7;
+	size_t pad = *start - *offset;
+	if(fwrite(zeros, 1, pad, file) != pad || (size > 0 && fwrite(data, 1, size, file) != size))
+		return 1;
+	*offset = *start + size;
+	return 0;
+}
+
+//
+// Writes to a temporary file renamed over `path` once complete, so a failed
+// save never leaves a partial table behind, nor truncates one that is mapped.
+// Returns 0 on success.
+//
+int bpe_save(const char *path) {
+    size_t path_len = strlen(path);
+    char *tmp_path = malloc(path_len + 5);
+    if (tmp_path == NULL) {
+        fprintf(stderr, "[ERROR] Failed to save %s\n", path);
+        return 1;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "[ERROR] Failed to open file for saving: %s\n", tmp_path);
+        free(tmp_path);
+        return 1;
+    }
+
+    SymbolTable *t = &global_symbols;
+    MergeTable *m = &global_merges;
+
+    //
+    // NOTE: bpe_load() wants an empty slot in every index, even of an empty table.
+    //
+    if (t->slot_count == 0) sym_grow(t);
+    if (m->slot_count == 0) merge_rebuild(m);
+
+    BpeFileHeader header = {0};
+    memcpy(header.magic, BPE_MAGIC, 4);
+    header.version = BPE_VERSION;
+    header.endian = BPE_ENDIAN;
+    header.header_size = sizeof(BpeFileHeader);
+    header.sym_count = t->count;
+    header.strings_len = t->strings_len;
+    header.sym_slot_count = t->slot_count;
+    header.pair_count = m->count;
+    header.pair_slot_count = m->slot_count;
+
+    //
+    // NOTE: Write the sections first, then come back for the header.
+    //
+    uint64_t offset = sizeof(BpeFileHeader);
+    int failed = fseek(file, offset, SEEK_SET) != 0
+        || bpe_write_section(file, &offset, &header.syms_offset, t->syms, t->count * sizeof(SymbolInfo)) > 0
+        || bpe_write_section(file, &offset, &header.strings_offset, t->strings, t->strings_len) > 0
+        || bpe_write_section(file, &offset, &header.sym_slots_offset, t->slots, t->slot_count * sizeof(Symbol)) > 0
+        || bpe_write_section(file, &offset, &header.pairs_offset, m->pairs, m->count * sizeof(Pair)) > 0
+        || bpe_write_section(file, &offset, &header.pair_slots_offset, m->pair_slots, m->slot_count * sizeof(uint32_t)) > 0
+        || bpe_write_section(file, &offset, &header.left_slots_offset, m->left_slots, m->slot_count * sizeof(uint32_t)) > 0
+        || fseek(file, 0, SEEK_SET) != 0
+        || fwrite(&header, sizeof(BpeFileHeader), 1, file) != 1;
+    if (fclose(file) != 0) failed = 1;
+    if (!failed && rename(tmp_path, path) != 0) failed = 1;
+    if (failed) {
+        fprintf(stderr, "[ERROR] Failed to write %s\n", path);
+        remove(tmp_path);
+        free(tmp_path);
+        return 1;
+    }
+    free(tmp_path);
+
+    printf("[INFO] Saved %zu symbols and %zu pairs to %s\n", t->count, m->count, path);
+    return 0;
+}
+
+int bpe_section_ok(size_t size, uint64_t offset, uint64_t count, size_t stride) {
+	if(offset % 8 != 0 || offset > size) return 0;
+	return count <= (size - offset) / stride;
+}
+
+//
+// One pass over the sections of a mapped table whose bounds are already
+// checked, so that nothing read from them later indexes out of bounds or
+// probes forever: every lexeme's text lies in the pool and is NUL-terminated,
+// merged symbols only refer to smaller ids, rules to existing symbols, and
+// every index is a power of two with at least one empty slot and slots that
+// hold valid entries.
+//
+int bpe_tables_ok(const BpeFileHeader *h, const char *base) {
+	const SymbolInfo *syms = (const SymbolInfo *)(base + h->syms_offset);
+	const char *strings = base + h->strings_offset;
+	uint64_t *text_len = malloc((h->sym_count + 1) * sizeof(uint64_t));
+	if(text_len == NULL) return 0;
+
+	//
+	// NOTE: The decoded text of every id, as decode_build() lays it out, has
+	// to fit its 32-bit offsets.
+	//
+	uint64_t decoded = 0;
+	size_t lexemes = 0, i = 0;
+	for(; i < h->sym_count; ++i) {
+		const SymbolInfo *s = &syms[i];
+		if(s->left == SYM_NONE) {
+			if((uint64_t)s->offset + s->len >= h->strings_len || strings[s->offset + s->len] != '\0')
+				break;
+			text_len[i] = s->len;
+			lexemes++;
+		} else if(s->left < i && s->right < i) {
+			text_len[i] = text_len[s->left] + 1 + text_len[s->right];
+		} else {
 			break;
 		}
+		decoded += text_len[i] + 1;
+		if(decoded > UINT32_MAX) break;
+	}
+	free(text_len);
+	if(i < h->sym_count) return 0;
+
+	const Pair *pairs = (const Pair *)(base + h->pairs_offset);
+	for(i = 0; i < h->pair_count; ++i)
+		if(pairs[i].a >= h->sym_count || pairs[i].b >= h->sym_count || pairs[i].item_id >= h->sym_count)
+			return 0;
+
+	if(h->sym_slot_count == 0 || (h->sym_slot_count & (h->sym_slot_count - 1)) != 0 || h->sym_slot_count <= lexemes)
+		return 0;
+	if(h->pair_slot_count == 0 || (h->pair_slot_count & (h->pair_slot_count - 1)) != 0 || h->pair_slot_count <= h->pair_count)
+		return 0;
+
+	const Symbol *sym_slots = (const Symbol *)(base + h->sym_slots_offset);
+	size_t empty = 0;
+	for(i = 0; i < h->sym_slot_count; ++i) {
+		if(sym_slots[i] == SYM_NONE) empty++;
+		else if(sym_slots[i] >= h->sym_count) return 0;
+	}
+	if(empty == 0) return 0;
+
+	const uint32_t *indexes[2] = {
+		(const uint32_t *)(base + h->pair_slots_offset),
+		(const uint32_t *)(base + h->left_slots_offset),
+	};
+	for(size_t k = 0; k < 2; ++k) {
+		empty = 0;
+		for(i = 0; i < h->pair_slot_count; ++i) {
+			if(indexes[k][i] == MERGE_NONE) empty++;
+			else if(indexes[k][i] >= h->pair_count) return 0;
+		}
+		if(empty == 0) return 0;
+	}
+	return 1;
+}
+
+//
+// Maps the table read-only and uses it in place, replacing the current one.
+// Returns the vocabulary size.
+//
+int bpe_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] Failed to open file for loading: %s\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BpeFileHeader)) {
+        fprintf(stderr, "[ERROR] Not a BPE table: %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "[ERROR] Failed to map %s\n", path);
+        return -1;
+    }
+
+    BpeFileHeader *h = data;
+    int ok = memcmp(h->magic, BPE_MAGIC, 4) == 0
+        && h->version == BPE_VERSION
+        && h->endian == BPE_ENDIAN
+        && h->header_size == sizeof(BpeFileHeader)
+        && h->sym_count < SYM_NONE
+        && h->pair_count < MERGE_NONE
+        && bpe_section_ok(size, h->syms_offset, h->sym_count, sizeof(SymbolInfo))
+        && bpe_section_ok(size, h->strings_offset, h->strings_len, 1)
+        && bpe_section_ok(size, h->sym_slots_offset, h->sym_slot_count, sizeof(Symbol))
+        && bpe_section_ok(size, h->pairs_offset, h->pair_count, sizeof(Pair))
+        && bpe_section_ok(size, h->pair_slots_offset, h->pair_slot_count, sizeof(uint32_t))
+        && bpe_section_ok(size, h->left_slots_offset, h->pair_slot_count, sizeof(uint32_t))
+        && bpe_tables_ok(h, data);
+    if (!ok) {
+        if (h->endian != BPE_ENDIAN && memcmp(h->magic, BPE_MAGIC, 4) == 0)
+            fprintf(stderr, "[ERROR] %s was written on a machine with another byte order\n", path);
+        else
+            fprintf(stderr, "[ERROR] Unsupported or corrupted BPE table: %s\n", path);
+        munmap(data, size);
+        return -1;
+    }
+
+    bpe_reset();
+    bpe_mapping = data;
+    bpe_mapping_size = size;
+
+    char *base = data;
+    SymbolTable *t = &global_symbols;
+    t->syms = (SymbolInfo *)(base + h->syms_offset);
+    t->strings = base + h->strings_offset;
+    t->slots = (Symbol *)(base + h->sym_slots_offset);
+    t->count = h->sym_count;
+    t->strings_len = h->strings_len;
+    t->slot_count = h->sym_slot_count;
+    t->mapped = 1;
+    for (size_t i = 0; i < t->count; ++i)
+        if (t->syms[i].left == SYM_NONE) t->used++;
+
+    MergeTable *m = &global_merges;
+    m->pairs = (Pair *)(base + h->pairs_offset);
+    m->pair_slots = (uint32_t *)(base + h->pair_slots_offset);
+    m->left_slots = (uint32_t *)(base + h->left_slots_offset);
+    m->count = h->pair_count;
+    m->slot_count = h->pair_slot_count;
+    m->mapped = 1;
+
+    decode_build(&global_decode, t);
+
+    printf("[INFO] Loaded %zu symbols and %zu pairs from %s\n", t->count, m->count, path);
+    return t->count;
+}
+
+void bpe_free() {
+	bpe_reset();
+
+	if(bpe_parser != NULL) {
+		ts_parser_delete(bpe_parser);
+		bpe_parser = NULL;
+	}
+
+	printf("[INFO] Clean up all global symbols and pairs.\n");
+}
+
+size_t bpe_test(char *input) {
+	Symbol *syms = bpe_lex(&global_symbols, input, strlen(input), 0);
+
+	if(arrlenu(syms) < 2) {
+		fprintf(stderr, "[ERROR] Not enough tokens.\n");
+		arrfree(syms);
+		return 1;
 	}
 
 	//
-	// Cleanup
+	// Find next token based on last token.
 	//
-	for(size_t i = 0; i < arrlenu(items); ++i)
-		free_item(items[i]);
-	arrfree(items);
+	uint32_t rank = merge_find_left(&global_merges, syms[arrlenu(syms) - 1]);
+	if(rank != MERGE_NONE)
+		print_symbol(&global_symbols, global_merges.pairs[rank].b);
+
+	arrfree(syms);
 	return 0;
 }
 
-// Return the string for a given BPE token id (from global_items)
+// Return the surface text for a given BPE token id
 const char* bpe_token_string(size_t id) {
-    if (!global_items) return NULL;
-    for (size_t i = 0; i < arrlenu(global_items); ++i) {
-        if (global_items[i]->id == id) {
-            if (global_items[i]->value.string)
-                return global_items[i]->value.string;
-            // For non-string tokens, return a static buffer
-            static char buf[32];
-            switch(global_items[i]->value.token) {
-                case CLEX_intlit:
-                    snprintf(buf, sizeof(buf), "%ld", global_items[i]->value.int_number);
-                    return buf;
-                case CLEX_floatlit:
-                    snprintf(buf, sizeof(buf), "%f", global_items[i]->value.real_number);
-                    return buf;
-                default:
-                    return "<UNK>";
-            }
-        }
-    }
-    return "<UNK>";
+    return decode_text(&global_decode, id);
+}
+
+// Decode a whole id sequence into `out`, returns the untruncated length
+size_t bpe_decode(const size_t *ids, size_t count, char *out, size_t out_len) {
+    return decode_ids(&global_decode, ids, count, out, out_len);
 }
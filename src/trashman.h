@@ -2,28 +2,107 @@
 #define TRASHMAN_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "stb_c_lexer.h"
 #include "stb_ds.h"
 
-typedef struct Item {
-    size_t id;
-    struct Item *left;
-    struct Item *right;
-    stb_lexer value;
-} Item;
+//
+// Every distinct lexeme and every merged token is a dense 32-bit symbol id.
+// Symbol 0 is reserved for tokens missing from the table.
+//
+typedef uint32_t Symbol;
+
+#define SYM_UNK 0
+#define SYM_NONE ((Symbol)0xFFFFFFFF)
+
+typedef struct SymbolInfo {
+    int token;       // CLEX_* kind of a lexeme, 0 for merged symbols
+    uint32_t offset; // surface text in the string arena
+    uint32_t len;
+    Symbol left;     // SYM_NONE unless merged
+    Symbol right;
+} SymbolInfo;
+
+//
+// Tables are stb_ds arrays, or views into the file mapped by bpe_load() until
+// their first write copies them out.
+//
+typedef struct SymbolTable {
+    SymbolInfo *syms;
+    char *strings;   // one arena for every lexeme
+    Symbol *slots;   // open addressing index over the lexemes
+    size_t count;
+    size_t strings_len;
+    size_t slot_count;
+    size_t used;
+    int mapped;
+} SymbolTable;
 
 typedef struct Pair {
-    Item *a;
-    Item *b;
-    size_t item_id;
+    Symbol a;
+    Symbol b;
+    Symbol item_id;
 } Pair;
 
+//
+// Learned merge rules, a rule's rank is its index in `pairs`.
+//
+typedef struct MergeTable {
+    Pair *pairs;
+    uint32_t *pair_slots; // (a, b) -> rank
+    uint32_t *left_slots; // a -> first rank starting with a
+    size_t count;
+    size_t slot_count;
+    int mapped;
+} MergeTable;
+
+#define MERGE_NONE ((uint32_t)0xFFFFFFFF)
+
+//
+// Id -> surface text, merged ids fully expanded.
+//
+typedef struct DecodeTable {
+    uint32_t *offsets; // count + 1 entries into text
+    char *text;
+    size_t count;
+} DecodeTable;
+
+//
+// Long-lived tokenizer which reparses and re-lexes only what changed in a
+// file since its last update.
+//
+typedef struct BpeTokenizer BpeTokenizer;
+
 // Functions and globals to share
-extern Pair **global_pairs;
-extern int items_equal(Item *a, Item *b);
-extern void copy_into_item(Item *a, stb_lexer *b);
+extern SymbolTable global_symbols;
+extern MergeTable global_merges;
+extern DecodeTable global_decode;
+extern Symbol sym_intern(SymbolTable *t, int token, const char *text, size_t len);
+extern Symbol sym_lookup(SymbolTable *t, int token, const char *text, size_t len);
+extern Symbol sym_merge(SymbolTable *t, Symbol left, Symbol right);
+extern const char* sym_text(SymbolTable *t, Symbol s);
+extern size_t sym_leaves(SymbolTable *t, Symbol s);
+extern void sym_free(SymbolTable *t);
+extern uint32_t merge_add(MergeTable *m, Symbol a, Symbol b, Symbol item_id);
+extern uint32_t merge_find(MergeTable *m, Symbol a, Symbol b);
+extern uint32_t merge_find_left(MergeTable *m, Symbol a);
+extern void merge_free(MergeTable *m);
+extern void decode_build(DecodeTable *d, SymbolTable *t);
+extern const char* decode_text(DecodeTable *d, size_t id);
+extern size_t decode_ids(DecodeTable *d, const size_t *ids, size_t count, char *out, size_t out_len);
+extern void decode_free(DecodeTable *d);
+extern Symbol *bpe_lex(SymbolTable *t, const char *input, size_t len, int intern);
+extern Symbol *bpe_lex_ends(SymbolTable *t, const char *input, size_t len, int intern, size_t **ends);
+extern size_t bpe_merge_symbols(MergeTable *m, Symbol *syms, size_t len);
+extern BpeTokenizer *bpe_tokenizer_new();
+extern int bpe_tokenizer_update(BpeTokenizer *t, const char *path);
+extern int bpe_tokenizer_update_source(BpeTokenizer *t, const char *path, const char *source, size_t len);
+extern const Symbol *bpe_tokenizer_tokens(BpeTokenizer *t, const char *path, size_t *len);
+extern Symbol *bpe_tokenizer_encode(BpeTokenizer *t, const char *path, size_t *len);
+extern void bpe_tokenizer_free(BpeTokenizer *t);
 extern void bpe_free();
 extern const char* bpe_token_string(size_t id);
+extern size_t bpe_decode(const size_t *ids, size_t count, char *out, size_t out_len);
 
 #endif // TRASHMAN_H
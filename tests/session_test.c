@@ -0,0 +1,79 @@
+//
+// Prediction sessions fed a piece at a time, ending in identifiers and
+// numbers, must predict exactly what a one-shot encode of the same text does.
+// Built and run under AddressSanitizer by `make test`.
+//
+#include "../src/jiraiya.c"
+
+const char *corpus =
+    "function add(first, second) { return first + second; }\n"
+    "const total = add(12, 30);\n"
+    "for (let index = 0; index < total; ++index) { console.log(index * 7); }\n"
+    "let result = total + 1024\n";
+
+//
+// Prediction after `text` encoded in one go, from a NUL-terminated copy.
+//
+size_t reference_predict(RnnModel *m, const char *text, size_t len) {
+    char *copy = malloc(len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+
+    size_t count = 0;
+    size_t *ids = bpe_encode(copy, len, &count);
+    float *xh = vec_create(m->embedding_dim + m->hidden_dim);
+    float *c = vec_create(m->hidden_dim);
+    float *z = vec_create(m->W.col);
+    float *scratch = vec_create(model_scratch(m));
+    for (size_t t = 0; t < count; ++t)
+        model_step(m, ids[t], xh, z, c);
+    size_t pred = model_predict(m, xh + m->embedding_dim, scratch);
+
+    free(xh);
+    free(c);
+    free(z);
+    free(scratch);
+    arrfree(ids);
+    free(copy);
+    return pred;
+}
+
+int main() {
+    Symbol *syms = bpe_lex(&global_symbols, corpus, strlen(corpus), 1);
+    arrfree(syms);
+    decode_build(&global_decode, &global_symbols);
+
+    RnnModel *m = calloc(1, sizeof(RnnModel));
+    if (m == NULL || model_create(m, CELL_LSTM, global_symbols.count, 16, 32, NULL, NULL, 0) > 0) return 1;
+    atomic_init(&m->refs, 1);
+    RnnSession *s = rnn_session_create(m);
+    if (s == NULL) return 1;
+
+    //
+    // Odd-sized pieces, so most of them end inside an identifier or a number
+    //
+    size_t len = strlen(corpus), failures = 0;
+    for (size_t at = 0, piece = 0; at < len; at += piece) {
+        piece = 1 + (at * 7 + 3) % 5;
+        if (piece > len - at) piece = len - at;
+        char text[8];
+        memcpy(text, corpus + at, piece);
+        text[piece] = '\0';
+        rnn_session_append(s, text);
+
+        char output[32];
+        rnn_session_predict(s, output, sizeof(output));
+        size_t expected = reference_predict(m, corpus, at + piece);
+        if ((size_t)atol(output) != expected) {
+            fprintf(stderr, "[ERROR] After %zu chars the session predicted %s, expected %zu\n", at + piece, output, expected);
+            failures++;
+        }
+    }
+
+    rnn_session_free(s);
+    model_release(m);
+    bpe_free();
+    if (failures > 0) return 1;
+    printf("[INFO] Session predictions match over %zu chars\n", len);
+    return 0;
+}